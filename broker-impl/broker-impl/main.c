@@ -1,30 +1,244 @@
 #include "lib/zhelpers.h"
 #include <float.h>
+#include <stdatomic.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <dispatch/dispatch.h>
 #include "include/common.h"
 #include "queue.h"
+#include "result_cache.h"
 #include "worker.h"
+#include "worker_index.h"
+#include "worker_map.h"
+#include "worker_table.h"
 
 #define REBALANCE_PACE_IN_SECONDS       1
 
+/* Workers sampled by the POWER_OF_CHOICES strategy, by default */
+#define DEFAULT_MAPPING_CHOICES         2
+
+/* In LATE_BINDING mode with size classes, the smaller tasks go first, unless
+ * a larger task has been pending for longer than this, in microseconds */
+#define LATE_BINDING_AGING_US           100000
+
+/* Dispatch latency histogram buckets: bucket b counts latencies that have b
+ * significant bits, in microseconds */
+#define LATENCY_BUCKETS                 64
+
+/* Inproc endpoint a shard's backend thread uses to wake up the I/O thread,
+ * formatted with the shard's id */
+#define DOORBELL_INPROC_LABEL           "inproc://broker-doorbell-%d"
+
+/* Schedulers, each with its own thread and workers, by default */
+#define DEFAULT_SHARDS                  1
+
+/* Frames after a server's READY: credits, CPUs, memory and network bandwidth */
+#define READY_FIELDS                    4
+
+/* Frames after a server's HEARTBEAT: CPU utilisation, memory in use and run
+ * queue length */
+#define HEARTBEAT_FIELDS                3
+
+/* Longest task report a server sends along with a task's output */
+#define TASK_REPORT_SIZE                128
+
+/* Largest number of tasks sent to a server in one message */
+#define MAX_DISPATCH_BATCH              16
+
+/* A batch goes beyond the server's free credits only with tasks that are short
+ * enough for the whole batch to run within this window, in microseconds */
+#define DISPATCH_BATCH_WINDOW_US        2000
+
+/* A shard hands tasks to another one when its backlog exceeds the other's by
+ * more than this many queued tasks per worker */
+#define SHARD_MIGRATION_THRESHOLD       4
+
+/* Lifetime of the cached outputs, by default */
+#define DEFAULT_RESULT_CACHE_TTL_SECONDS 60
+
 typedef enum {
     UNIFORM_DISTRIBUTION,
-    RESOURCES_MANAGEMENT
+    RESOURCES_MANAGEMENT,
+    /* JSQ(d): samples d workers at random and takes the one with the least
+     * effort; O(1) per task and it does not pile tasks on the worker that
+     * looks the least loaded at the moment */
+    POWER_OF_CHOICES,
+    /* Tasks wait in the broker's pending queues and are bound to a worker
+     * only when the worker is AVAILABLE, so that a slow task never delays
+     * the tasks behind it */
+    LATE_BINDING
 } tasks_mapping_strategy_t;
 
+typedef enum {
+    WORKER_READY,
+    WORKER_HEARTBEAT,
+    TASK_RECEIVED,
+    TASK_COMPLETED
+} broker_event_type_t;
+
+/* Completed task, as reported by its server along with the output */
+typedef struct __task_report_t {
+    /* Identity of the task's client, owned by the report */
+    char *client_id;
+    
+    /* Command and resources charged for the task, echoed by the server; the
+     * command is 0 if the server did not report the task */
+    struct __worker_task_t charged;
+    
+    /* Measured by the server: wall and CPU time, in microseconds, and maximum
+     * resident set size, in kilobytes */
+    long wall_time;
+    long cpu_time;
+    long max_rss;
+} task_report_t;
+
+/* Decoded message, passed from the I/O thread to a backend thread */
+typedef struct __broker_event_t {
+    broker_event_type_t type;
+    
+    /* Server's identity, for WORKER_READY, WORKER_HEARTBEAT and
+     * TASK_COMPLETED */
+    char *worker_id;
+    
+    /* Credits advertised by the server or 0, for WORKER_READY, and number of
+     * replies, for TASK_COMPLETED */
+    int count;
+    
+    /* New task, for TASK_RECEIVED */
+    worker_task_t task;
+    
+    /* Resources advertised by the server, 0 for the defaults, for
+     * WORKER_READY, and loads measured by the server, for WORKER_HEARTBEAT */
+    worker_statistics_t statistics;
+    
+    /* One report per reply, owned by the event, for TASK_COMPLETED */
+    task_report_t *reports;
+} *broker_event_t;
+
+/* Tasks to be sent to a server in one message, passed from a backend thread
+ * to the I/O thread */
+typedef struct __broker_dispatch_t {
+    /* Owned by the worker's state, which is never freed */
+    char *worker_id;
+    int count;
+    worker_task_t tasks[MAX_DISPATCH_BATCH];
+    
+    /* The tasks were lost along with their server's state: they are only
+     * records, and their clients get SERVER_ERROR_MESSAGE instead */
+    int failed;
+} *broker_dispatch_t;
+
+/* Partition of the workers with its own scheduler: a backend thread, the
+ * workers' queues, the pending tasks and a rebalancing pass. The I/O thread
+ * assigns every server to a shard when it registers and routes every client
+ * to a shard by the hash of its identity, so the shards share no lock. */
+typedef struct __broker_shard_t {
+    int shard_id;
+    pthread_t backend_thread;
+    
+    /* Decoded messages, from the I/O thread to the backend thread, and tasks
+     * to send, from the backend thread to the I/O thread */
+    queue_t events;
+    queue_t dispatches;
+    
+    /* Tasks handed over by the other shards' rebalancing passes */
+    queue_t migrations;
+    
+    /* Inproc PAIR sockets: the backend thread writes to the first one when it
+     * queues dispatches and the I/O thread polls the second one; at most one
+     * wakeup is in flight, while doorbell_rung is set */
+    void *doorbell_send;
+    void *doorbell_recv;
+    atomic_int doorbell_rung;
+    
+    /* Number of servers assigned to this shard; only used by the I/O thread */
+    int registered_servers;
+    
+    pthread_mutex_t mutex;
+    
+    /* Signalled, under the shard's mutex, when a task is queued or a worker
+     * becomes AVAILABLE; the backend thread sleeps on it when it has nothing
+     * to dispatch */
+    pthread_cond_t dispatch_cond;
+    
+    /* Set by the backend thread, under the shard's mutex, before it checks
+     * the events one last time and sleeps; the I/O thread only takes the
+     * mutex to wake it up while it is set */
+    atomic_int sleeping;
+    
+    /* Dispatch statistics, updated by the backend thread */
+    long dispatched_tasks;
+    long dispatched_batches;
+    long dispatch_wakeups;
+    int64_t dispatch_latency_total;
+    int64_t dispatch_latency_max;
+    long dispatch_latency_histogram[LATENCY_BUCKETS];
+    long steals;
+    long stolen_tasks;
+    
+    /* Tasks handed over to the other shards */
+    long migrated_tasks;
+    
+    /* Random state of POWER_OF_CHOICES */
+    uint32_t mapping_seed;
+    
+    /* LATE_BINDING pending tasks, one queue per size class in use */
+    queue_t pending_tasks[TASK_SIZE_CLASSES];
+    
+    /* Registered workers, grown on demand */
+    worker_table_t workers;
+    
+    /* Index over the workers, by load, by effort and by dispatchability;
+     * updated under the shard's mutex whenever a worker changes */
+    worker_index_t worker_index;
+    
+    /* Servers' identities to the workers' slots */
+    worker_map_t worker_map;
+    
+    /* Queued tasks and workers that are not DEAD, published by every
+     * rebalancing pass for the other shards' passes */
+    atomic_int backlog;
+    atomic_int live_workers;
+    
+    /* Workers load and candidates of the rebalancing pass, grown along with
+     * the workers table */
+    double *snapshot;
+    worker_load_classes_t classes;
+    int snapshot_capacity;
+} *broker_shard_t;
+
 typedef struct __broker_state_t {
+    void *context;
+    
+    /* The sockets are only used by the I/O thread, i.e. the main thread */
     void *frontend;
     void *backend;
-    int workers_count;
-    pthread_t backend_thread;
     
-    pthread_mutex_t mutex;
+    broker_shard_t *shards;
+    int shards_count;
+    
+    /* Servers' identities to their shards, and the number of servers; only
+     * used by the I/O thread. Clients are not served before a server
+     * registered */
+    worker_map_t server_shards;
+    int registered_servers;
+    
+    /* Outputs of the clients' requests, NULL unless enabled; only used by the
+     * I/O thread */
+    result_cache_t result_cache;
+    
+    int64_t start_time;
     
     tasks_mapping_strategy_t tasks_mapping_strategy;
     
-    /* Do not accept more than 1024 server connections */
-    worker_state_t worker_queue[1024];
+    /* Number of sampled workers of POWER_OF_CHOICES */
+    int mapping_choices;
+    
+    /* Number of LATE_BINDING size classes in use */
+    int pending_classes;
+    
+    /* Policy of the workers' tasks queues */
+    balancing_policy_t tasks_balancing_policy;
     
     void (*old_sigterm_handler)(int);
     
@@ -39,15 +253,60 @@ static broker_state_t *instance;
 static
 void dump_broker_snapshot(void);
 
+/* Returns the current time, in microseconds */
+static
+int64_t s_clock_us(void);
+
+/* Creates a shard, with its doorbell sockets, and starts its backend thread */
+static
+broker_shard_t new_shard(int shard_id);
+
+/* Frees the memory occupied by a shard whose backend thread is not running */
+static
+void delete_shard(broker_shard_t shard);
+
+/* Returns the shard of a server, assigning the one with the fewest servers to
+ * a new server; called by the I/O thread */
+static
+broker_shard_t find_shard_for_server(char *worker_id);
+
+/* Returns the shard of a client, by the hash of its identity; a shard without
+ * servers passes its clients on to the next one. Called by the I/O thread. */
+static
+broker_shard_t find_shard_for_client(char *client_id);
+
+/* Wakes up a shard's backend thread; the caller must hold the shard's mutex */
+static
+void notify_dispatcher(broker_shard_t shard);
+
+/* Hands a decoded message to a shard's backend thread; called by the I/O
+ * thread. The statistics, if any, are copied and the reports are handed over */
+static
+void post_event(broker_shard_t shard, broker_event_type_t type, char *worker_id,
+    int count, worker_task_t task, worker_statistics_t *statistics,
+    task_report_t *reports);
+
+/* Hands a batch of tasks to the I/O thread and wakes it up if needed; called
+ * by the shard's backend thread */
+static
+void post_dispatch(broker_shard_t shard, broker_dispatch_t dispatch);
+
+/* Sends the tasks queued by a shard's backend thread; called by the I/O
+ * thread */
+static
+void send_dispatches(broker_shard_t shard);
 
-/* Compares two pointers (memory addresses) */
+/* Refreshes a worker's hot fields and its entries in the workers index; the
+ * caller must hold the shard's mutex */
 static
-int __pointer_compare(void *key1, void *key2);
+void reindex_worker(broker_shard_t shard, int worker_id);
 
 
-/* Backend thread's loop; it does the followings:
- *   1) if an available server has assigned a task, it sends
- *   out the task for execution;
+/* Backend thread's loop, one per shard; it does the followings:
+ *   0) it applies the messages decoded by the I/O thread: new servers,
+ *   new tasks and completed tasks, and the tasks migrated from other shards;
+ *   1) if an available server has assigned a task, it hands the task
+ *   to the I/O thread, which sends it out for execution;
  *   2) load balancing: tasks stealing (another server has more
  *   tasks to execute) and tasks shrinking (a server has too few
  *   tasks to execute, so another server takes them)
@@ -56,25 +315,89 @@ static
 void *backend_loop(void *input);
 
 
-/* Searches for the first free slot for a new worker state */
+/* Searches for the first free slot for a new worker state, growing the
+ * workers table if there is none; returns INVALID_WORKER_ID if it cannot grow */
 static
-int find_new_worker_index(void);
+int find_new_worker_index(broker_shard_t shard);
 
 /* Searches for a worker to take care of a new task */
 static
-int find_best_worker_for_new_task(void);
+int find_best_worker_for_new_task(broker_shard_t shard);
 
 /* Searches for workers that are available and have tasks to execute */
 static
-int find_best_worker_for_task_dispatch(void);
+int find_best_worker_for_task_dispatch(broker_shard_t shard);
+
+/* Binds the next pending task to an AVAILABLE worker without tasks, in
+ * LATE_BINDING mode; returns the worker, or INVALID_WORKER_ID if there is no
+ * such worker or no pending task. The caller must hold the shard's mutex. */
+static
+int bind_pending_task(broker_shard_t shard, worker_task_t *task);
+
+/* Removes the next pending task, smaller tasks first unless a larger one waits
+ * for too long; returns NULL if there is none */
+static
+worker_task_t pop_pending_task(broker_shard_t shard);
+
+/* Returns how many tasks to send to a worker in one message: its free credits
+ * or, if its tasks are measured to be short, as many as run within
+ * DISPATCH_BATCH_WINDOW_US; in LATE_BINDING mode, a worker gets no more than
+ * its share of the pending tasks beyond its free credits */
+static
+int dispatch_batch_limit(broker_shard_t shard, worker_state_t worker_state);
+
+/* Moves half of the longest backlog, which belongs to a BUSY worker, to an
+ * AVAILABLE worker without tasks; returns the thief or INVALID_WORKER_ID if
+ * there was nothing to steal. The caller must hold the shard's mutex. */
+static
+int steal_tasks_for_idle_worker(broker_shard_t shard);
 
 
-/* Server interaction delegate */
+/* Server interaction delegate, run by the I/O thread */
 static void server_delegate(void);
 
-/* Client interaction delegate */
+/* Reads the report a server might send between a reply's client identity and
+ * its empty frame, up to the empty frame */
+static void read_task_report(task_report_t *report);
+
+/* Caches the output of a client's request and sends it to the clients that
+ * joined that request */
+static void reply_joined_clients(char *client_id, zmq_msg_t *reply);
+
+/* Gives up on the cached requests that ran for longer than the cache's TTL,
+ * and sends SERVER_ERROR_MESSAGE to the clients that joined them; run by the
+ * I/O thread at the rebalancing pace */
+static void expire_result_cache(void);
+
+/* Sends SERVER_ERROR_MESSAGE to the clients of a failed dispatch, and frees
+ * it */
+static void reply_failed_tasks(broker_dispatch_t dispatch);
+
+/* Frees a TASK_COMPLETED event's reports */
+static void free_task_reports(task_report_t *reports, int count);
+
+/* Client interaction delegate, run by the I/O thread */
 static void client_delegate(void);
 
+/* Backend thread's handlers for the events posted by the delegates; the
+ * caller must hold the shard's mutex */
+static void handle_worker_ready(broker_shard_t shard, char *worker_id, int credits,
+    worker_statistics_t *capacity);
+static void handle_worker_heartbeat(broker_shard_t shard, char *worker_id,
+    worker_statistics_t *load);
+static void handle_task_completed(broker_shard_t shard, char *worker_id,
+    int tasks_count, task_report_t *reports);
+static void handle_new_task(broker_shard_t shard, worker_task_t task);
+
+/* Withdraws the charges of a worker's tasks in flight, which its server lost,
+ * and hands them to the I/O thread to reply to their clients; called by the
+ * backend thread */
+static void fail_tasks_in_flight(broker_shard_t shard, worker_state_t worker_state);
+
+/* Handles all the posted events and migrated tasks; the caller must hold the
+ * shard's mutex */
+static void process_events(broker_shard_t shard);
+
 
 /* SIGTERM signal handler used to free the resources allocated by this broker */
 static
@@ -84,14 +407,64 @@ void sigterm_handler(int signum);
 static
 void init_rebalance_broker(void);
 
-/* Stops the world and rebalances the broker, e.g. relocates tasks from a loaded
- * worker; do not call this function directly, it is scheduled on the global
- * dispatch queue, to run every REBALANCE_PACE_IN_SECONDS seconds
+/* Stops the shard's world and rebalances it, e.g. relocates tasks from a
+ * loaded worker, then migrates tasks to another shard if their backlogs
+ * diverged; do not call this function directly, it is scheduled on the global
+ * dispatch queue, to run every REBALANCE_PACE_IN_SECONDS seconds for every
+ * shard
  */
 static
-void rebalance_broker(void);
+void rebalance_broker(broker_shard_t shard);
+
+/* Prints the broker's command line options */
+static
+void usage(char *name);
 
-int main(void) {
+int main(int argc, char **argv) {
+    balancing_policy_t tasks_balancing_policy = MPSC_FIFO;
+    tasks_mapping_strategy_t tasks_mapping_strategy = RESOURCES_MANAGEMENT;
+    int mapping_choices = DEFAULT_MAPPING_CHOICES;
+    int pending_classes = 1;
+    int shards_count = DEFAULT_SHARDS;
+    long result_cache_size = 0;
+    long result_cache_ttl = DEFAULT_RESULT_CACHE_TTL_SECONDS;
+    int option;
+    
+    while ((option = getopt(argc, argv, "q:m:d:s:c:t:")) != -1) {
+        if (option == 'q' && !strcmp(optarg, "fifo")) {
+            tasks_balancing_policy = MPSC_FIFO;
+        } else if (option == 'q' && !strcmp(optarg, "priority")) {
+            tasks_balancing_policy = PRIORITY;
+        } else if (option == 'q' && !strcmp(optarg, "round-robin")) {
+            tasks_balancing_policy = ROUND_ROBIN;
+        } else if (option == 'q' && !strcmp(optarg, "random")) {
+            tasks_balancing_policy = RANDOM;
+        } else if (option == 'm' && !strcmp(optarg, "resources")) {
+            tasks_mapping_strategy = RESOURCES_MANAGEMENT;
+        } else if (option == 'm' && !strcmp(optarg, "effort")) {
+            tasks_mapping_strategy = UNIFORM_DISTRIBUTION;
+        } else if (option == 'm' && !strcmp(optarg, "choices")) {
+            tasks_mapping_strategy = POWER_OF_CHOICES;
+        } else if (option == 'm' && !strcmp(optarg, "late")) {
+            tasks_mapping_strategy = LATE_BINDING;
+            pending_classes = 1;
+        } else if (option == 'm' && !strcmp(optarg, "late-classes")) {
+            tasks_mapping_strategy = LATE_BINDING;
+            pending_classes = TASK_SIZE_CLASSES;
+        } else if (option == 'd' && atoi(optarg) > 0) {
+            mapping_choices = atoi(optarg);
+        } else if (option == 's' && atoi(optarg) > 0) {
+            shards_count = atoi(optarg);
+        } else if (option == 'c' && atol(optarg) > 0) {
+            result_cache_size = atol(optarg);
+        } else if (option == 't' && atol(optarg) > 0) {
+            result_cache_ttl = atol(optarg);
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    
     void *context = zmq_ctx_new ();
     
     void *frontend = zmq_socket (context, ZMQ_ROUTER);
@@ -101,43 +474,205 @@ int main(void) {
     zmq_bind (backend,  BACKEND_IPC_LABEL);
     
     instance = (broker_state_t *)malloc(sizeof(broker_state_t));
+    instance->context = context;
     instance->frontend = frontend;
     instance->backend = backend;
-    instance->workers_count = 0;
-    instance->tasks_mapping_strategy = RESOURCES_MANAGEMENT;
-    pthread_mutex_init(&instance->mutex, NULL);
-    pthread_create(&instance->backend_thread, NULL, backend_loop, NULL);
+    instance->server_shards = worker_map_new();
+    instance->registered_servers = 0;
+    instance->result_cache = result_cache_size ?
+        result_cache_new((size_t) result_cache_size << 20,
+            result_cache_ttl * 1000000LL) : NULL;
+    instance->tasks_mapping_strategy = tasks_mapping_strategy;
+    instance->mapping_choices = mapping_choices;
+    instance->pending_classes = pending_classes;
+    instance->tasks_balancing_policy = tasks_balancing_policy;
+    instance->start_time = s_clock_us();
+    
+    instance->shards_count = shards_count;
+    instance->shards = (broker_shard_t *) malloc(shards_count * sizeof(broker_shard_t));
+    int it;
+    for (it = 0; it < shards_count; it++) {
+        instance->shards[it] = new_shard(it);
+    }
     
     instance->old_sigterm_handler = signal(SIGTERM, sigterm_handler);
-
+    
     init_rebalance_broker();
     
+    // The backend, then every shard's doorbell, then the frontend, which is
+    // polled only once a server registered
+    zmq_pollitem_t *items = (zmq_pollitem_t *)
+        calloc(shards_count + 2, sizeof(zmq_pollitem_t));
+    items[0].socket = backend;
+    items[0].events = ZMQ_POLLIN;
+    for (it = 0; it < shards_count; it++) {
+        items[it + 1].socket = instance->shards[it]->doorbell_recv;
+        items[it + 1].events = ZMQ_POLLIN;
+    }
+    items[shards_count + 1].socket = frontend;
+    items[shards_count + 1].events = ZMQ_POLLIN;
+    
+    // I/O thread: the only one that receives or sends on the sockets; with
+    // the cache, it wakes up at the rebalancing pace to expire it
+    long timeout = instance->result_cache ?
+        instance->rebalance_pace_in_seconds * 1000L : -1;
+    int64_t next_expiration = s_clock_us() + timeout * 1000;
     while (1) {
-        zmq_pollitem_t items[] = {
-            { backend, 0, ZMQ_POLLIN, 0 },
-            { frontend, 0, ZMQ_POLLIN, 0 },
-        };
-        
-        int rc = zmq_poll (items, instance->workers_count ? 2 : 1, -1);
+        int polled = instance->registered_servers ? shards_count + 2 : shards_count + 1;
+        int rc = zmq_poll (items, polled, timeout);
         if (rc == -1)
             break;
         
+        if (instance->result_cache && s_clock_us() >= next_expiration) {
+            expire_result_cache();
+            next_expiration = s_clock_us() + timeout * 1000;
+        }
         if (items[0].revents & ZMQ_POLLIN) {
             server_delegate();
         }
-        if (items[1].revents & ZMQ_POLLIN) {
+        for (it = 0; it < shards_count; it++) {
+            if (items[it + 1].revents & ZMQ_POLLIN) {
+                send_dispatches(instance->shards[it]);
+            }
+        }
+        if (polled == shards_count + 2 &&
+            (items[shards_count + 1].revents & ZMQ_POLLIN)) {
             client_delegate();
         }
     }
     
+    free(items);
     zmq_close(instance->frontend);
     zmq_close(instance->backend);
+    for (it = 0; it < shards_count; it++) {
+        zmq_close(instance->shards[it]->doorbell_send);
+        zmq_close(instance->shards[it]->doorbell_recv);
+    }
     zmq_ctx_destroy(context);
+    for (it = 0; it < shards_count; it++) {
+        delete_shard(instance->shards[it]);
+    }
+    free(instance->shards);
+    worker_map_delete(instance->server_shards);
+    result_cache_delete(instance->result_cache);
     free(instance);
     
     return 0;
 }
 
+void usage(char *name) {
+    printf("usage: %s [-q fifo|priority|round-robin|random] [-m resources|effort|choices|late|late-classes]"
+           " [-d choices] [-s shards] [-c megabytes] [-t seconds]\n", name);
+    printf("  -q  workers' tasks queues: lock-free FIFO (default), ordered by the\n"
+           "      deadline sent by the client, earliest first, or, under the worker's\n"
+           "      mutex, a FIFO list or a random order\n");
+    printf("  -m  tasks mapping: the least loaded worker that is neither IDLE nor\n"
+           "      full (default), the worker with the least effort, or the one with\n"
+           "      the least effort among -d randomly sampled workers (default %d);\n"
+           "      or keep the tasks in the broker until a worker is AVAILABLE, in one\n"
+           "      queue or in one queue per tasks size class, shorter tasks first\n",
+           DEFAULT_MAPPING_CHOICES);
+    printf("  -s  number of schedulers, each with its own thread and its own share\n"
+           "      of the servers; clients are spread over them by identity (default %d)\n",
+           DEFAULT_SHARDS);
+    printf("  -c  answer the requests identical to a previous one with its output,\n"
+           "      keeping up to this many megabytes of outputs, each one for -t\n"
+           "      seconds (default %d); only for commands whose output does not\n"
+           "      change from one run to the next\n",
+           DEFAULT_RESULT_CACHE_TTL_SECONDS);
+}
+
+broker_shard_t new_shard(int shard_id) {
+    broker_shard_t shard = (broker_shard_t) calloc(1, sizeof(struct __broker_shard_t));
+    char label[64];
+    int it;
+    
+    shard->shard_id = shard_id;
+    shard->events = queue_new(SPSC_RING);
+    shard->dispatches = queue_new(SPSC_RING);
+    shard->migrations = queue_new(MPSC_FIFO);
+    
+    snprintf(label, sizeof(label), DOORBELL_INPROC_LABEL, shard_id);
+    shard->doorbell_recv = zmq_socket (instance->context, ZMQ_PAIR);
+    zmq_bind (shard->doorbell_recv, label);
+    shard->doorbell_send = zmq_socket (instance->context, ZMQ_PAIR);
+    zmq_connect (shard->doorbell_send, label);
+    atomic_init(&shard->doorbell_rung, 0);
+    
+    worker_table_init(&shard->workers);
+    shard->worker_index = worker_index_new();
+    shard->worker_map = worker_map_new();
+    shard->mapping_seed = ((uint32_t) s_clock_us() + shard_id * 2654435761u) | 1;
+    for (it = 0; it < instance->pending_classes; it++) {
+        shard->pending_tasks[it] = queue_new(instance->tasks_balancing_policy);
+    }
+    atomic_init(&shard->backlog, 0);
+    atomic_init(&shard->live_workers, 0);
+    
+    pthread_mutex_init(&shard->mutex, NULL);
+    pthread_cond_init(&shard->dispatch_cond, NULL);
+    atomic_init(&shard->sleeping, 0);
+    pthread_create(&shard->backend_thread, NULL, backend_loop, shard);
+    
+    return shard;
+}
+
+void delete_shard(broker_shard_t shard) {
+    int it;
+    
+    worker_index_delete(shard->worker_index);
+    worker_map_delete(shard->worker_map);
+    worker_table_destroy(&shard->workers);
+    queue_delete(shard->events);
+    queue_delete(shard->dispatches);
+    queue_delete(shard->migrations);
+    for (it = 0; it < instance->pending_classes; it++) {
+        queue_delete(shard->pending_tasks[it]);
+    }
+    free(shard->snapshot);
+    free(shard->classes.idle);
+    free(shard->classes.overload);
+    free(shard);
+}
+
+broker_shard_t find_shard_for_server(char *worker_id) {
+    int shard_id = worker_map_get(instance->server_shards, worker_id);
+    if (shard_id != INVALID_WORKER_ID) {
+        return instance->shards[shard_id];
+    }
+    
+    int it;
+    shard_id = 0;
+    for (it = 1; it < instance->shards_count; it++) {
+        if (instance->shards[it]->registered_servers <
+            instance->shards[shard_id]->registered_servers) {
+            shard_id = it;
+        }
+    }
+    
+    // The shard owns the identity sent with the event, so keep a copy
+    worker_map_put(instance->server_shards, strdup(worker_id), shard_id);
+    instance->shards[shard_id]->registered_servers++;
+    instance->registered_servers++;
+    
+    return instance->shards[shard_id];
+}
+
+broker_shard_t find_shard_for_client(char *client_id) {
+    int shard_id = worker_map_hash(client_id) % instance->shards_count;
+    int it;
+    
+    for (it = 0; it < instance->shards_count; it++) {
+        broker_shard_t shard =
+            instance->shards[(shard_id + it) % instance->shards_count];
+        if (shard->registered_servers) {
+            return shard;
+        }
+    }
+    
+    return instance->shards[shard_id];
+}
+
 
 void server_delegate(void) {
     char *worker_id = s_recv (instance->backend);
@@ -145,206 +680,967 @@ void server_delegate(void) {
     
     char *empty = s_recv (instance->backend); free(empty);
     
-    char *client_id = s_recv (instance->backend);
+    // Either READY or the first reply's client identity, which goes back to
+    // the frontend as received
+    zmq_msg_t client_id;
+    s_recv_frame (instance->backend, &client_id);
     
-    if (!strcmp (client_id, "READY")) {
-        /* Create the worker's state */
-        worker_state_t worker_state = (worker_state_t)
-            malloc(sizeof(struct __worker_state_t));
-        worker_state->worker_id = worker_id;
-        worker_state->status = AVAILABLE;
-        worker_state->tasks = queue_new(ROUND_ROBIN);
-        pthread_mutex_init(&worker_state->mutex, NULL);
-        init_default_runtime_settings(&worker_state->runtime);
+    if (s_frame_equals (&client_id, "READY")) {
+        zmq_msg_close (&client_id);
         
-        int worker_index = find_new_worker_index();
-        instance->worker_queue[worker_index] = worker_state;
-    } else {
-        empty = s_recv(instance->backend); free(empty);
+        // The server might send how many tasks it runs at once, then its
+        // online CPUs, its memory in megabytes and its network bandwidth in
+        // megabytes per second; 0 for those it does not know
+        long advertised[READY_FIELDS] = { 0 };
+        int it, more;
+        size_t more_size = sizeof(more);
+        for (it = 0; it < READY_FIELDS; it++) {
+            zmq_getsockopt (instance->backend, ZMQ_RCVMORE, &more, &more_size);
+            if (!more) {
+                break;
+            }
+            char *field = s_recv (instance->backend);
+            if (atol(field) > 0) {
+                advertised[it] = atol(field);
+            }
+            free (field);
+        }
         
-        char *reply = s_recv(instance->backend);
+        worker_statistics_t capacity;
+        capacity.cpu = advertised[1] * RESOURCE_CPU_PER_CORE;
+        capacity.memory = advertised[2];
+        capacity.network = advertised[3];
         
-        s_sendmore (instance->frontend, client_id);
-        s_sendmore (instance->frontend, "");
-        s_send     (instance->frontend, reply);
+        post_event(find_shard_for_server(worker_id), WORKER_READY, worker_id,
+            (int) advertised[0], NULL, &capacity, NULL);
+    } else if (s_frame_equals (&client_id, "HEARTBEAT")) {
+        zmq_msg_close (&client_id);
+        
+        // The server's CPU utilisation and memory in use, as fractions, and
+        // its runnable processes
+        double measured[HEARTBEAT_FIELDS] = { 0.0 };
+        int it, more;
+        size_t more_size = sizeof(more);
+        for (it = 0; it < HEARTBEAT_FIELDS; it++) {
+            zmq_getsockopt (instance->backend, ZMQ_RCVMORE, &more, &more_size);
+            if (!more) {
+                break;
+            }
+            char *field = s_recv (instance->backend);
+            measured[it] = atof(field);
+            free (field);
+        }
         
-        free (reply);
+        worker_statistics_t load;
+        load.cpu_load = measured[0];
+        load.memory_load = measured[1];
+        load.run_queue = measured[2];
         
-        int it;
-        for (it = 0; it < instance->workers_count; it++) {
-            worker_state_t worker_state = instance->worker_queue[it];
-            if (worker_state->status == BUSY &&
-                !strcmp(worker_state->worker_id, worker_id)) {
-                pthread_mutex_lock (&worker_state->mutex);
-                worker_state->status = AVAILABLE;
-                worker_state->runtime.completed_tasks++;
-                update_worker_runtime(&(worker_state->runtime), NULL, -1);
-                pthread_mutex_unlock (&worker_state->mutex);
+        int shard_id = worker_map_get(instance->server_shards, worker_id);
+        if (shard_id != INVALID_WORKER_ID && it == HEARTBEAT_FIELDS) {
+            post_event(instance->shards[shard_id], WORKER_HEARTBEAT, worker_id,
+                0, NULL, &load, NULL);
+        } else {
+            free(worker_id);
+        }
+    } else {
+        // One or more replies, each one a client's identity, the task's
+        // report, if any, an empty frame and the command's output
+        task_report_t *reports = NULL;
+        int replies = 0, reports_capacity = 0;
+        
+        while (1) {
+            // Without memory for its report, the reply is still forwarded, but
+            // its task stays charged to the server until it registers again
+            task_report_t dropped, *report = &dropped;
+            if (replies == reports_capacity) {
+                int capacity = reports_capacity ? 2 * reports_capacity : 4;
+                task_report_t *_reports = (task_report_t *) realloc(reports,
+                    capacity * sizeof(task_report_t));
+                if (_reports) {
+                    reports = _reports;
+                    reports_capacity = capacity;
+                }
+            }
+            if (replies < reports_capacity) {
+                report = &reports[replies];
+            }
+            read_task_report(report);
+            report->client_id = s_frame_strndup(&client_id,
+                zmq_msg_size (&client_id));
+            
+            // The output is forwarded without a copy, whatever its size
+            zmq_msg_t reply;
+            s_recv_frame (instance->backend, &reply);
+            int more = zmq_msg_more (&reply);
+            
+            if (instance->result_cache) {
+                reply_joined_clients(report->client_id, &reply);
+            }
+            
+            s_send_frame (instance->frontend, &client_id, ZMQ_SNDMORE);
+            s_sendmore   (instance->frontend, "");
+            s_send_frame (instance->frontend, &reply, 0);
+            
+            if (report == &dropped) {
+                free(report->client_id);
+            } else {
+                replies++;
+            }
+            
+            if (!more) {
                 break;
             }
+            
+            s_recv_frame (instance->backend, &client_id);
+        }
+        
+        int shard_id = worker_map_get(instance->server_shards, worker_id);
+        if (shard_id != INVALID_WORKER_ID) {
+            post_event(instance->shards[shard_id], TASK_COMPLETED, worker_id,
+                replies, NULL, NULL, reports);
+        } else {
+            free(worker_id);
+            free_task_reports(reports, replies);
         }
     }
-    free(client_id);
 }
 
-void client_delegate(void) {
-    // Received a new request from a client
-    char *client_id = s_recv (instance->frontend);
-    char *empty = s_recv (instance->frontend); free (empty);
-    char *request = s_recv (instance->frontend);
+void read_task_report(task_report_t *report) {
+    memset(report, 0, sizeof(task_report_t));
     
-    // Find the best worker to can deal with the task
-    pthread_mutex_lock (&instance->mutex);
-    int worker_id = find_best_worker_for_new_task();
-    pthread_mutex_unlock (&instance->mutex);
-    
-    // Get the current worker's state
-    worker_state_t worker_state = instance->worker_queue[worker_id];
+    zmq_msg_t frame;
+    s_recv_frame (instance->backend, &frame);
+    if (!zmq_msg_size (&frame)) {
+        // The empty frame: the server did not report the task
+        zmq_msg_close (&frame);
+        return;
+    }
     
-    // Get the current worker's tasks queue
-    queue_t tasks = worker_state->tasks;
-
-    // Create a new task object
-    worker_task_t task = new_task(client_id, request);
+    // "command:cpu:memory:network wall_time cpu_time max_rss", the command
+    // and its charges as sent along with the task, or "-" if none were
+    char *text = s_frame_strndup(&frame, TASK_REPORT_SIZE);
+    zmq_msg_close (&frame);
     
-    // Add the task to the current worker's task
-    pthread_mutex_lock (&worker_state->mutex);
+    unsigned int command = 0;
+    struct __worker_task_t *charged = &report->charged;
+    if (sscanf(text, "%x:%ld:%ld:%ld %ld %ld %ld", &command, &charged->cpu,
+        &charged->memory, &charged->network, &report->wall_time,
+        &report->cpu_time, &report->max_rss) == 7) {
+        charged->command = command;
+    } else {
+        charged->command = 0;
+    }
+    free(text);
     
-    queue_push(tasks, task);
+    char *empty = s_recv (instance->backend); free(empty);
+}
+
+void reply_joined_clients(char *client_id, zmq_msg_t *reply) {
+    int joined_count, it;
+    char **joined = result_cache_complete(instance->result_cache, client_id,
+        zmq_msg_data (reply), zmq_msg_size (reply),
+        !s_frame_equals(reply, SERVER_ERROR_MESSAGE), s_clock_us(),
+        &joined_count);
     
-    update_worker_runtime(&worker_state->runtime, request, 1);
+    // Large outputs are shared by the copies rather than copied
+    for (it = 0; it < joined_count; it++) {
+        zmq_msg_t output;
+        zmq_msg_init (&output);
+        zmq_msg_copy (&output, reply);
+        
+        s_sendmore   (instance->frontend, joined[it]);
+        s_sendmore   (instance->frontend, "");
+        s_send_frame (instance->frontend, &output, 0);
+        free(joined[it]);
+    }
+    free(joined);
+}
+
+void expire_result_cache(void) {
+    int joined_count, it;
+    char **joined = result_cache_expire(instance->result_cache, s_clock_us(),
+        &joined_count);
     
-    pthread_mutex_unlock (&worker_state->mutex);
+    for (it = 0; it < joined_count; it++) {
+        s_sendmore (instance->frontend, joined[it]);
+        s_sendmore (instance->frontend, "");
+        s_send     (instance->frontend, SERVER_ERROR_MESSAGE);
+        free(joined[it]);
+    }
+    free(joined);
 }
 
-void *backend_loop(void *input) {
-    while (1) {
-        pthread_mutex_lock (&instance->mutex);
-        int worker_id = find_best_worker_for_task_dispatch();
-        pthread_mutex_unlock (&instance->mutex);
-        
-        if (worker_id == INVALID_WORKER_ID) {
-            // No workers are available
-            // FIXME: replace this with a monitor event
-            usleep(100);
-            continue;
-        }
-        
-        worker_state_t worker_state = instance->worker_queue[worker_id];
-        queue_t tasks = worker_state->tasks;
+void reply_failed_tasks(broker_dispatch_t dispatch) {
+    int it;
+    
+    for (it = 0; it < dispatch->count; it++) {
+        worker_task_t task = dispatch->tasks[it];
         
-        pthread_mutex_lock (&worker_state->mutex);
-        worker_task_t task = (worker_task_t) queue_get_key(tasks);
-
-        if (task) {
-            queue_remove_key(tasks, task, __pointer_compare);
+        zmq_msg_t reply;
+        zmq_msg_init_size (&reply, strlen(SERVER_ERROR_MESSAGE));
+        memcpy(zmq_msg_data (&reply), SERVER_ERROR_MESSAGE,
+            strlen(SERVER_ERROR_MESSAGE));
+        if (instance->result_cache) {
+            reply_joined_clients(task->client_id, &reply);
         }
-        pthread_mutex_unlock (&worker_state->mutex);
         
-        if (!task) {
-            // No tasks available
-            continue;
-        }
-
-        worker_state->status = BUSY;
+        s_sendmore   (instance->frontend, task->client_id);
+        s_sendmore   (instance->frontend, "");
+        s_send_frame (instance->frontend, &reply, 0);
         
-        s_sendmore (instance->backend, worker_state->worker_id);
-        s_sendmore (instance->backend, "");
-        s_sendmore (instance->backend, task->client_id);
-        s_sendmore (instance->backend, "");
-        s_send     (instance->backend, task->request);
+        free(task->client_id);
         free(task);
     }
-    return NULL;
+    free(dispatch);
 }
 
-int __pointer_compare(void *key1, void *key2) {
-    return ((key1 < key2) ? -1 : ((key1 == key2) ? 0 : 1));
-}
-
-int find_new_worker_index(void) {
+void free_task_reports(task_report_t *reports, int count) {
     int it;
-    for (it = 0; it < instance->workers_count; it++) {
-        /* Return the first DEAD worker index */
-        if (instance->worker_queue[it]->status == DEAD) {
-            return it;
-        }
+    
+    for (it = 0; it < count; it++) {
+        free(reports[it].client_id);
     }
-    return instance->workers_count++;
+    free(reports);
 }
 
-int find_best_worker_for_new_task(void) {
-    int it;
-    double best_load = DBL_MAX, least_load = 1.0;
-    int best_worker_id = INVALID_WORKER_ID;
+void client_delegate(void) {
+    // Received a new request from a client
+    char *client_id = s_recv (instance->frontend);
+    char *empty = s_recv (instance->frontend); free (empty);
     
-    if (instance->tasks_mapping_strategy == RESOURCES_MANAGEMENT) {
-        // If we do resource management, then we find a non-full loaded
-        // worker who can take care of the task
-        for (it = 0; it < instance->workers_count; it++) {
-            if (instance->worker_queue[it]->status == DEAD) {
-                continue;
-            }
-            
-            worker_state_t worker_state = instance->worker_queue[it];
-            double worker_load = get_runtime_load(&worker_state->runtime);
-            
-            if (worker_load == 0.0) {
-                // Ignore IDLE workers
-                continue;
-            }
-            
-            if (least_load > worker_load) {
-                least_load = worker_load;
-                best_worker_id = it;
-            }
+    // The request goes to the server as received, without a copy; only its
+    // head is read, for the cost estimates
+    zmq_msg_t *payload = (zmq_msg_t *) malloc(sizeof(zmq_msg_t));
+    s_recv_frame (instance->frontend, payload);
+    char *request = s_frame_strndup(payload, REQUEST_HEAD_SIZE);
+    
+    // The client might send the task's deadline, in milliseconds from now;
+    // a deadline that is not a number, negative or out of range is ignored
+    long priority = QUEUE_DEFAULT_PRIORITY;
+    int more;
+    size_t more_size = sizeof(more);
+    zmq_getsockopt (instance->frontend, ZMQ_RCVMORE, &more, &more_size);
+    if (more) {
+        char *deadline = s_recv (instance->frontend);
+        char *end;
+        long now = (long) s_clock();
+        long delay = strtol(deadline, &end, 10);
+        if (end != deadline && !*end && delay >= 0 &&
+            delay < QUEUE_DEFAULT_PRIORITY - now) {
+            priority = now + delay;
         }
+        free (deadline);
+        zmq_getsockopt (instance->frontend, ZMQ_RCVMORE, &more, &more_size);
     }
     
-    if (best_worker_id == INVALID_WORKER_ID) {
-        for (it = 0; it < instance->workers_count; it++) {
-            if (instance->worker_queue[it]->status == DEAD) {
-                continue;
-            }
+    // Any further frames are dropped, or they would be read as the next
+    // client's request
+    while (more) {
+        zmq_msg_t frame;
+        if (s_recv_frame (instance->frontend, &frame) == -1) {
+            break;
+        }
+        more = zmq_msg_more (&frame);
+        zmq_msg_close (&frame);
+    }
+    
+    // The request might be answered from the cache, or along with the same
+    // request that is running
+    if (instance->result_cache) {
+        const void *output;
+        size_t output_size;
+        result_cache_status_t status = result_cache_lookup(
+            instance->result_cache, client_id, zmq_msg_data (payload),
+            zmq_msg_size (payload), s_clock_us(), &output, &output_size);
         
-            double worker_load = get_runtime_effort(
-                &(instance->worker_queue[it]->runtime),
-                instance->worker_queue[it]->status
-            );
-
-            if (worker_load < best_load) {
-                best_load = worker_load;
-                best_worker_id = it;
+        if (status != RESULT_CACHE_MISS) {
+            if (status == RESULT_CACHE_HIT) {
+                s_sendmore (instance->frontend, client_id);
+                s_sendmore (instance->frontend, "");
+                zmq_send (instance->frontend, output, output_size, 0);
             }
+            free(client_id);
+            free(request);
+            zmq_msg_close (payload);
+            free(payload);
+            return;
         }
     }
     
-    assert(best_worker_id >= 0 && best_worker_id < instance->workers_count);
+    // Create a new task object
+    worker_task_t task = new_task(client_id, request);
+    task->payload = payload;
+    task->priority = priority;
+    task->enqueue_time = s_clock_us();
     
-    return best_worker_id;
-}
-
-int find_best_worker_for_task_dispatch(void) {
-    int it;
-    for (it = 0; it < instance->workers_count; it++) {
-        if (instance->worker_queue[it]->status == AVAILABLE) {
-            return it;
-        }
-    }
-    return INVALID_WORKER_ID;
+    post_event(find_shard_for_client(client_id), TASK_RECEIVED, NULL, 0, task,
+        NULL, NULL);
+}
+
+void fail_tasks_in_flight(broker_shard_t shard, worker_state_t worker_state) {
+    broker_dispatch_t dispatch = NULL;
+    
+    pthread_mutex_lock (&worker_state->mutex);
+    while (worker_state->in_flight) {
+        worker_task_t task = worker_state->in_flight_tasks[--worker_state->in_flight];
+        charge_worker_task(&worker_state->runtime, task, -1);
+        
+        if (!dispatch) {
+            dispatch = (broker_dispatch_t) malloc(sizeof(struct __broker_dispatch_t));
+            if (!dispatch) {
+                free(task->client_id);
+                free(task);
+                continue;
+            }
+            dispatch->worker_id = worker_state->worker_id;
+            dispatch->count = 0;
+            dispatch->failed = 1;
+        }
+        
+        dispatch->tasks[dispatch->count++] = task;
+        if (dispatch->count == MAX_DISPATCH_BATCH) {
+            post_dispatch(shard, dispatch);
+            dispatch = NULL;
+        }
+    }
+    pthread_mutex_unlock (&worker_state->mutex);
+    
+    if (dispatch) {
+        post_dispatch(shard, dispatch);
+    }
+}
+
+void handle_worker_ready(broker_shard_t shard, char *worker_id, int credits,
+    worker_statistics_t *capacity) {
+    int worker_index = worker_map_get(shard->worker_map, worker_id);
+    
+    // Servers that advertise credits also take batches of tasks
+    int max_batch = credits ? MAX_DISPATCH_BATCH : 1;
+    if (!credits) {
+        credits = DEFAULT_WORKER_CREDITS;
+    }
+    
+    if (worker_index != INVALID_WORKER_ID) {
+        /* A known server came back: whatever it was running is lost, but
+         * its queued tasks are still waiting for it */
+        worker_state_t worker_state = shard->workers.states[worker_index];
+        fail_tasks_in_flight(shard, worker_state);
+        worker_state->status = AVAILABLE;
+        worker_state->credits = credits;
+        worker_state->max_batch = max_batch;
+        pthread_mutex_lock (&worker_state->mutex);
+        set_worker_capacity(&worker_state->runtime, capacity->cpu,
+            capacity->memory, capacity->network);
+        pthread_mutex_unlock (&worker_state->mutex);
+        free(worker_id);
+    } else {
+        /* Create the worker's state */
+        worker_state_t worker_state = (worker_state_t)
+            malloc(sizeof(struct __worker_state_t));
+        worker_state->worker_id = worker_id;
+        worker_state->status = AVAILABLE;
+        worker_state->credits = credits;
+        worker_state->in_flight = 0;
+        worker_state->in_flight_tasks = NULL;
+        worker_state->in_flight_capacity = 0;
+        worker_state->max_batch = max_batch;
+        worker_state->tasks = queue_new(instance->tasks_balancing_policy);
+        pthread_mutex_init(&worker_state->mutex, NULL);
+        init_default_runtime_settings(&worker_state->runtime);
+        set_worker_capacity(&worker_state->runtime, capacity->cpu,
+            capacity->memory, capacity->network);
+        
+        int workers_count = shard->workers.count;
+        worker_index = find_new_worker_index(shard);
+        if (worker_index == INVALID_WORKER_ID) {
+            /* Out of memory: ignore the server until it registers again */
+            queue_delete(worker_state->tasks);
+            free(worker_state);
+            free(worker_id);
+            return;
+        }
+        if (worker_index < workers_count) {
+            /* Reusing a DEAD worker's slot */
+            worker_map_remove(shard->worker_map,
+                shard->workers.states[worker_index]->worker_id);
+        }
+        worker_table_set(&shard->workers, worker_index, worker_state);
+        worker_map_put(shard->worker_map, worker_id, worker_index);
+    }
+    
+    reindex_worker(shard, worker_index);
+}
+
+void handle_worker_heartbeat(broker_shard_t shard, char *worker_id,
+    worker_statistics_t *load) {
+    int it = worker_map_get(shard->worker_map, worker_id);
+    if (it != INVALID_WORKER_ID &&
+        shard->workers.states[it]->status != DEAD) {
+        worker_state_t worker_state = shard->workers.states[it];
+        
+        pthread_mutex_lock (&worker_state->mutex);
+        blend_measured_load(&worker_state->runtime, load->cpu_load,
+            load->memory_load, load->run_queue);
+        pthread_mutex_unlock (&worker_state->mutex);
+        
+        reindex_worker(shard, it);
+    }
+    free(worker_id);
+}
+
+void handle_task_completed(broker_shard_t shard, char *worker_id,
+    int tasks_count, task_report_t *reports) {
+    int it = worker_map_get(shard->worker_map, worker_id);
+    if (it != INVALID_WORKER_ID) {
+        worker_state_t worker_state = shard->workers.states[it];
+        int64_t now = s_clock_us();
+        int report, completed = 0;
+        
+        pthread_mutex_lock (&worker_state->mutex);
+        for (report = 0; report < tasks_count; report++) {
+            // The replies of the tasks that were given up on, when the server
+            // sent READY again, are not counted
+            task_report_t *task_report = &reports[report];
+            worker_task_t task = worker_untrack_task(worker_state,
+                task_report->client_id);
+            if (!task) {
+                continue;
+            }
+            
+            // Credits are free again, and the same resources that were
+            // charged are withdrawn
+            completed++;
+            record_task_duration(&worker_state->runtime,
+                (double) (now - task->enqueue_time));
+            charge_worker_task(&worker_state->runtime, task, -1);
+            
+            // The measured costs go to the next tasks with the same command,
+            // unless it could not run
+            if (task_report->charged.command && task_report->wall_time > 0) {
+                record_command_cost(task_report->charged.command,
+                    task_report->wall_time, task_report->cpu_time,
+                    task_report->max_rss);
+            }
+            
+            free(task->client_id);
+            free(task);
+        }
+        if (completed) {
+            worker_state->status = AVAILABLE;
+            worker_state->runtime.completed_tasks += completed;
+        }
+        pthread_mutex_unlock (&worker_state->mutex);
+        
+        reindex_worker(shard, it);
+    }
+    free(worker_id);
+}
+
+void handle_new_task(broker_shard_t shard, worker_task_t task) {
+    if (instance->tasks_mapping_strategy == LATE_BINDING) {
+        // The task is bound to a worker when one becomes AVAILABLE
+        int size_class = instance->pending_classes > 1 ?
+            get_task_size_class(task->request) : 0;
+        queue_push_priority(shard->pending_tasks[size_class], task, task->priority);
+        return;
+    }
+    
+    // Find the best worker to can deal with the task
+    int worker_id = find_best_worker_for_new_task(shard);
+    
+    // Get the current worker's state
+    worker_state_t worker_state = shard->workers.states[worker_id];
+    
+    // Add the task to the current worker's task
+    worker_push_task(worker_state, task);
+    
+    pthread_mutex_lock (&worker_state->mutex);
+    charge_worker_task(&worker_state->runtime, task, 1);
+    pthread_mutex_unlock (&worker_state->mutex);
+    
+    reindex_worker(shard, worker_id);
+}
+
+void process_events(broker_shard_t shard) {
+    broker_event_t event;
+    worker_task_t task;
+    
+    while ((event = (broker_event_t) queue_pop(shard->events))) {
+        if (event->type == WORKER_READY) {
+            handle_worker_ready(shard, event->worker_id, event->count,
+                &event->statistics);
+        } else if (event->type == WORKER_HEARTBEAT) {
+            handle_worker_heartbeat(shard, event->worker_id, &event->statistics);
+        } else if (event->type == TASK_COMPLETED) {
+            handle_task_completed(shard, event->worker_id, event->count,
+                event->reports);
+            free_task_reports(event->reports, event->count);
+        } else {
+            handle_new_task(shard, event->task);
+        }
+        free(event);
+    }
+    
+    // Migrated tasks are mapped as if their clients had sent them here
+    while ((task = (worker_task_t) queue_pop(shard->migrations))) {
+        handle_new_task(shard, task);
+    }
+}
+
+void *backend_loop(void *input) {
+    broker_shard_t shard = (broker_shard_t) input;
+    
+    pthread_mutex_lock (&shard->mutex);
+    
+    while (1) {
+        process_events(shard);
+        
+        int worker_id = find_best_worker_for_task_dispatch(shard);
+        worker_task_t task = NULL;
+        
+        if (worker_id == INVALID_WORKER_ID &&
+            instance->tasks_mapping_strategy == LATE_BINDING) {
+            worker_id = bind_pending_task(shard, &task);
+        }
+        
+        if (worker_id == INVALID_WORKER_ID) {
+            // An AVAILABLE worker without tasks takes over some of the tasks
+            // that wait behind a BUSY worker, instead of waiting for the
+            // rebalancing module
+            worker_id = steal_tasks_for_idle_worker(shard);
+        }
+        
+        if (worker_id == INVALID_WORKER_ID) {
+            // Either the I/O thread sees the flag after its push, or this
+            // thread sees the pushed event
+            atomic_store_explicit(&shard->sleeping, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            
+            if (queue_get_size(shard->events) ||
+                queue_get_size(shard->migrations)) {
+                atomic_store_explicit(&shard->sleeping, 0, memory_order_relaxed);
+                continue;
+            }
+            
+            // No available worker has tasks; wait for a new task or for a
+            // worker to become AVAILABLE
+            pthread_cond_wait (&shard->dispatch_cond, &shard->mutex);
+            atomic_store_explicit(&shard->sleeping, 0, memory_order_relaxed);
+            shard->dispatch_wakeups++;
+            continue;
+        }
+        
+        worker_state_t worker_state = shard->workers.states[worker_id];
+        
+        // Tasks queues have a single consumer: whoever holds the shard's
+        // mutex, i.e. this thread or the rebalancing module
+        if (!task) {
+            task = worker_pop_task(worker_state);
+        }
+        
+        if (!task) {
+            // A producer has not finished its push yet
+            continue;
+        }
+        
+        broker_dispatch_t dispatch = (broker_dispatch_t)
+            malloc(sizeof(struct __broker_dispatch_t));
+        dispatch->worker_id = worker_state->worker_id;
+        dispatch->tasks[0] = task;
+        dispatch->count = 1;
+        dispatch->failed = 0;
+        
+        // More tasks for the same worker go in the same message
+        int limit = dispatch_batch_limit(shard, worker_state);
+        while (dispatch->count < limit) {
+            if (queue_get_size(worker_state->tasks)) {
+                task = worker_pop_task(worker_state);
+            } else if (instance->tasks_mapping_strategy == LATE_BINDING &&
+                (task = pop_pending_task(shard))) {
+                pthread_mutex_lock (&worker_state->mutex);
+                charge_worker_task(&worker_state->runtime, task, 1);
+                pthread_mutex_unlock (&worker_state->mutex);
+            } else {
+                task = NULL;
+            }
+            if (!task) {
+                break;
+            }
+            dispatch->tasks[dispatch->count++] = task;
+        }
+        
+        // The worker keeps taking tasks until it runs out of credits; a task
+        // that cannot be recorded is not counted, and its charges are
+        // withdrawn at once
+        int64_t now = s_clock_us();
+        int it;
+        for (it = 0; it < dispatch->count; it++) {
+            if (worker_track_task(worker_state, dispatch->tasks[it], now)) {
+                pthread_mutex_lock (&worker_state->mutex);
+                charge_worker_task(&worker_state->runtime, dispatch->tasks[it], -1);
+                pthread_mutex_unlock (&worker_state->mutex);
+            }
+        }
+        if (worker_state->in_flight >= worker_state->credits) {
+            worker_state->status = BUSY;
+        }
+        reindex_worker(shard, worker_id);
+        
+        for (it = 0; it < dispatch->count; it++) {
+            // The latency ends at the hand off to the I/O thread
+            int64_t latency = now - dispatch->tasks[it]->enqueue_time;
+            shard->dispatch_latency_total += latency;
+            if (latency > shard->dispatch_latency_max) {
+                shard->dispatch_latency_max = latency;
+            }
+            shard->dispatch_latency_histogram[latency > 0 ?
+                64 - __builtin_clzll((unsigned long long) latency) : 0]++;
+        }
+        shard->dispatched_tasks += dispatch->count;
+        shard->dispatched_batches++;
+        
+        // The I/O thread sends the batch and frees it. Only this thread posts
+        // the shard's dispatches, so the mutex is released meanwhile, giving
+        // the rebalancing module a chance to run
+        pthread_mutex_unlock (&shard->mutex);
+        
+        post_dispatch(shard, dispatch);
+        
+        pthread_mutex_lock (&shard->mutex);
+    }
+    return NULL;
+}
+
+int64_t s_clock_us(void) {
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void notify_dispatcher(broker_shard_t shard) {
+    pthread_cond_signal (&shard->dispatch_cond);
+}
+
+void post_event(broker_shard_t shard, broker_event_type_t type, char *worker_id,
+    int count, worker_task_t task, worker_statistics_t *statistics,
+    task_report_t *reports) {
+    broker_event_t event = (broker_event_t) malloc(sizeof(struct __broker_event_t));
+    event->type = type;
+    event->worker_id = worker_id;
+    event->count = count;
+    event->task = task;
+    if (statistics) {
+        event->statistics = *statistics;
+    }
+    event->reports = reports;
+    
+    queue_push(shard->events, event);
+    
+    // The backend thread sets its flag, then checks the events, under the
+    // mutex, before sleeping: the I/O thread never waits for a scheduling
+    // pass, and a wakeup cannot be lost
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&shard->sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock (&shard->mutex);
+        notify_dispatcher(shard);
+        pthread_mutex_unlock (&shard->mutex);
+    }
+}
+
+void post_dispatch(broker_shard_t shard, broker_dispatch_t dispatch) {
+    queue_push(shard->dispatches, dispatch);
+    
+    if (!atomic_exchange(&shard->doorbell_rung, 1)) {
+        zmq_send (shard->doorbell_send, "", 0, ZMQ_DONTWAIT);
+    }
+}
+
+void send_dispatches(broker_shard_t shard) {
+    char doorbell;
+    while (zmq_recv (shard->doorbell_recv, &doorbell, sizeof(doorbell),
+        ZMQ_DONTWAIT) >= 0);
+    
+    // Dispatches queued from now on ring the doorbell again
+    atomic_exchange(&shard->doorbell_rung, 0);
+    
+    broker_dispatch_t dispatch;
+    while ((dispatch = (broker_dispatch_t) queue_pop(shard->dispatches))) {
+        if (dispatch->failed) {
+            reply_failed_tasks(dispatch);
+            continue;
+        }
+        
+        s_sendmore (instance->backend, dispatch->worker_id);
+        s_sendmore (instance->backend, "");
+        
+        // Every task is a client's identity, an empty frame and the request
+        int it;
+        for (it = 0; it < dispatch->count; it++) {
+            worker_task_t task = dispatch->tasks[it];
+            
+            // The server echoes the command and its charges in its report
+            char charged[TASK_REPORT_SIZE];
+            snprintf(charged, sizeof(charged), "%x:%ld:%ld:%ld", task->command,
+                task->cpu, task->memory, task->network);
+            
+            s_sendmore   (instance->backend, task->client_id);
+            s_sendmore   (instance->backend, charged);
+            s_sendmore   (instance->backend, "");
+            s_send_frame (instance->backend, (zmq_msg_t *) task->payload,
+                it + 1 < dispatch->count ? ZMQ_SNDMORE : 0);
+            
+            free(task->client_id);
+            free(task->request);
+            free(task->payload);
+            free(task);
+        }
+        free(dispatch);
+    }
+}
+
+void reindex_worker(broker_shard_t shard, int worker_id) {
+    worker_table_refresh(&shard->workers, worker_id);
+    worker_index_update(shard->worker_index, worker_id,
+        shard->workers.states[worker_id]);
+}
+
+int find_new_worker_index(broker_shard_t shard) {
+    int it;
+    for (it = 0; it < shard->workers.count; it++) {
+        /* Return the first DEAD worker index */
+        if (shard->workers.status[it] == DEAD) {
+            return it;
+        }
+    }
+    
+    if (worker_table_reserve(&shard->workers, shard->workers.count + 1)) {
+        return INVALID_WORKER_ID;
+    }
+    return shard->workers.count++;
+}
+
+int find_best_worker_for_new_task(broker_shard_t shard) {
+    int best_worker_id = INVALID_WORKER_ID;
+    
+    if (instance->tasks_mapping_strategy == RESOURCES_MANAGEMENT) {
+        // If we do resource management, then we find a non-full loaded
+        // worker who can take care of the task; IDLE workers are not indexed
+        best_worker_id = worker_index_least_loaded(shard->worker_index);
+    } else if (instance->tasks_mapping_strategy == POWER_OF_CHOICES) {
+        best_worker_id = worker_table_least_effort_of(&shard->workers,
+            instance->mapping_choices, &shard->mapping_seed);
+    }
+    
+    if (best_worker_id == INVALID_WORKER_ID) {
+        best_worker_id = worker_index_least_effort(shard->worker_index);
+    }
+    
+    assert(best_worker_id >= 0 && best_worker_id < shard->workers.count);
+    
+    return best_worker_id;
+}
+
+int find_best_worker_for_task_dispatch(broker_shard_t shard) {
+    // Resumes after the last dispatched worker, so the workers take turns
+    return worker_index_next_dispatchable(shard->worker_index);
+}
+
+worker_task_t pop_pending_task(broker_shard_t shard) {
+    int size_class, best_class = INVALID_WORKER_ID;
+    int64_t now = s_clock_us();
+    
+    // The first class with pending tasks, unless a larger class has a task
+    // that waits for too long
+    for (size_class = 0; size_class < instance->pending_classes; size_class++) {
+        worker_task_t head = (worker_task_t)
+            queue_peek(shard->pending_tasks[size_class], NULL);
+        if (!head) {
+            continue;
+        }
+        if (best_class == INVALID_WORKER_ID ||
+            now - head->enqueue_time > LATE_BINDING_AGING_US) {
+            best_class = size_class;
+        }
+    }
+    
+    if (best_class == INVALID_WORKER_ID) {
+        return NULL;
+    }
+    
+    return (worker_task_t) queue_pop(shard->pending_tasks[best_class]);
+}
+
+int bind_pending_task(broker_shard_t shard, worker_task_t *task) {
+    int size_class, pending = 0;
+    
+    for (size_class = 0; size_class < instance->pending_classes; size_class++) {
+        pending += queue_get_size(shard->pending_tasks[size_class]);
+    }
+    
+    if (!pending) {
+        return INVALID_WORKER_ID;
+    }
+    
+    int worker_id = worker_index_next_idle(shard->worker_index);
+    if (worker_id == INVALID_WORKER_ID) {
+        return INVALID_WORKER_ID;
+    }
+    
+    *task = pop_pending_task(shard);
+    
+    worker_state_t worker_state = shard->workers.states[worker_id];
+    pthread_mutex_lock (&worker_state->mutex);
+    charge_worker_task(&worker_state->runtime, *task, 1);
+    pthread_mutex_unlock (&worker_state->mutex);
+    
+    return worker_id;
+}
+
+int dispatch_batch_limit(broker_shard_t shard, worker_state_t worker_state) {
+    int limit = worker_state->credits - worker_state->in_flight;
+    
+    // Short tasks: enough of them to amortize the messaging, even if the
+    // server queues some of them
+    double duration = worker_state->runtime.task_duration;
+    if (duration > 0.0 && DISPATCH_BATCH_WINDOW_US / duration > limit) {
+        int window = (int) (DISPATCH_BATCH_WINDOW_US / duration);
+        
+        if (instance->tasks_mapping_strategy == LATE_BINDING) {
+            // Binding more than a fair share would keep the other workers idle
+            int size_class, pending = 0;
+            for (size_class = 0; size_class < instance->pending_classes; size_class++) {
+                pending += queue_get_size(shard->pending_tasks[size_class]);
+            }
+            int share = 1 + pending / (shard->workers.count ? shard->workers.count : 1);
+            if (window > share) {
+                window = share;
+            }
+        }
+        
+        if (window > limit) {
+            limit = window;
+        }
+    }
+    
+    if (limit > worker_state->max_batch) {
+        limit = worker_state->max_batch;
+    }
+    return limit > 0 ? limit : 1;
+}
+
+int steal_tasks_for_idle_worker(broker_shard_t shard) {
+    int victim = worker_index_most_backlogged(shard->worker_index);
+    if (victim == INVALID_WORKER_ID) {
+        return INVALID_WORKER_ID;
+    }
+    
+    int thief = worker_index_next_idle(shard->worker_index);
+    if (thief == INVALID_WORKER_ID) {
+        return INVALID_WORKER_ID;
+    }
+    
+    unsigned int moved = relocate_worker_tasks(shard->workers.states[victim],
+        shard->workers.states[thief],
+        (queue_get_size(shard->workers.states[victim]->tasks) + 1) >> 1);
+    
+    reindex_worker(shard, victim);
+    reindex_worker(shard, thief);
+    
+    if (!moved) {
+        return INVALID_WORKER_ID;
+    }
+    
+    shard->steals++;
+    shard->stolen_tasks += moved;
+    
+    return thief;
 }
 
 void dump_broker_snapshot(void) {
-    pthread_mutex_lock (&instance->mutex);
-    int worker_id;
+    long dispatched_tasks = 0, dispatch_wakeups = 0, steals = 0, stolen_tasks = 0;
+    long migrated_tasks = 0, dispatched_batches = 0;
+    int64_t dispatch_latency_total = 0, dispatch_latency_max = 0;
+    long dispatch_latency_histogram[LATENCY_BUCKETS] = { 0 };
+    int shard_id, worker_id, it;
     
-    printf("tasks mapping strategy %d\n", instance->tasks_mapping_strategy);
-    for (worker_id = 0; worker_id < instance->workers_count; worker_id++) {
-        printf("worker id %d\n", worker_id);
-        debug_worker_state(instance->worker_queue[worker_id]);
-        printf("\n");
+    printf("tasks mapping strategy %d, %d shards\n",
+        instance->tasks_mapping_strategy, instance->shards_count);
+    
+    for (shard_id = 0; shard_id < instance->shards_count; shard_id++) {
+        broker_shard_t shard = instance->shards[shard_id];
+        pthread_mutex_lock (&shard->mutex);
+        
+        printf("shard %d: workers %d, dispatched tasks %ld, migrated tasks %ld\n",
+            shard_id, shard->workers.count, shard->dispatched_tasks,
+            shard->migrated_tasks);
+        
+        dispatched_tasks += shard->dispatched_tasks;
+        dispatched_batches += shard->dispatched_batches;
+        dispatch_wakeups += shard->dispatch_wakeups;
+        steals += shard->steals;
+        stolen_tasks += shard->stolen_tasks;
+        migrated_tasks += shard->migrated_tasks;
+        dispatch_latency_total += shard->dispatch_latency_total;
+        if (shard->dispatch_latency_max > dispatch_latency_max) {
+            dispatch_latency_max = shard->dispatch_latency_max;
+        }
+        for (it = 0; it < LATENCY_BUCKETS; it++) {
+            dispatch_latency_histogram[it] += shard->dispatch_latency_histogram[it];
+        }
+        
+        for (it = 0; it < instance->pending_classes; it++) {
+            printf("pending tasks, size class %d: %d\n", it,
+                queue_get_size(shard->pending_tasks[it]));
+        }
+        
+        for (worker_id = 0; worker_id < shard->workers.count; worker_id++) {
+            printf("worker id %d\n", worker_id);
+            debug_worker_state(shard->workers.states[worker_id]);
+            printf("\n");
+        }
+        pthread_mutex_unlock (&shard->mutex);
+    }
+    
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double uptime = (s_clock_us() - instance->start_time) / 1e6;
+    double cpu_time = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    printf("cpu time %.3lfs in %.3lfs uptime (%.1lf%% busy)\n",
+        cpu_time, uptime, uptime > 0 ? 100.0 * cpu_time / uptime : 0.0);
+    printf("dispatched tasks %ld in %ld batches, dispatcher wakeups %ld\n",
+        dispatched_tasks, dispatched_batches, dispatch_wakeups);
+    printf("dispatch latency avg %.1lfus, max %lldus\n",
+        dispatched_tasks ?
+            (double) dispatch_latency_total / dispatched_tasks : 0.0,
+        (long long) dispatch_latency_max);
+    printf("steals %ld, stolen tasks %ld, migrated tasks %ld\n",
+        steals, stolen_tasks, migrated_tasks);
+    
+    if (instance->result_cache) {
+        result_cache_statistics_t cache;
+        result_cache_get_statistics(instance->result_cache, &cache);
+        printf("result cache hits %ld, misses %ld, joined %ld, saved dispatches %ld\n",
+            cache.hits, cache.misses, cache.joined, cache.hits + cache.joined);
+        printf("result cache entries %ld, %zu bytes, evictions %ld, expirations %ld, "
+            "abandoned %ld\n", cache.entries, cache.size, cache.evictions,
+            cache.expirations, cache.abandoned);
+    }
+    
+    // Upper bounds of the dispatch latency percentiles
+    double percentiles[] = { 0.5, 0.99, 0.999 };
+    long seen = 0;
+    int bucket = 0;
+    for (it = 0; it < 3; it++) {
+        while (bucket < LATENCY_BUCKETS - 1 &&
+            seen + dispatch_latency_histogram[bucket] <
+                percentiles[it] * dispatched_tasks) {
+            seen += dispatch_latency_histogram[bucket++];
+        }
+        printf("dispatch latency p%g < %lldus\n", 100 * percentiles[it],
+            bucket ? 1LL << bucket : 1LL);
     }
-    pthread_mutex_unlock (&instance->mutex);
 }
 
 void sigterm_handler(int signum)
@@ -353,9 +1649,22 @@ void sigterm_handler(int signum)
     instance->old_sigterm_handler(signum);
 }
 
+/* Runs the shard's rebalancing pass in rebalance_pace_in_seconds seconds */
+static
+void schedule_rebalance_broker(broker_shard_t shard);
+
 void init_rebalance_broker(void)
 {
+    int it;
+    
     instance->rebalance_pace_in_seconds = REBALANCE_PACE_IN_SECONDS;
+    for (it = 0; it < instance->shards_count; it++) {
+        schedule_rebalance_broker(instance->shards[it]);
+    }
+}
+
+void schedule_rebalance_broker(broker_shard_t shard)
+{
     dispatch_after(
         dispatch_time(
             DISPATCH_TIME_NOW,
@@ -363,136 +1672,244 @@ void init_rebalance_broker(void)
         ),
         dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
         ^(void) {
-            rebalance_broker();
+            rebalance_broker(shard);
         }
     );
 }
 
 static
-void _rebalance_broker(void);
+void _rebalance_broker(broker_shard_t shard);
+
+static
+int _relebance_needed(worker_load_classes_t *classes);
 
+// Publishes the shard's backlog for the other shards' rebalancing passes
 static
-int _relebance_needed(double *snapshot, int workers_count);
+void _publish_shard_backlog(broker_shard_t shard);
 
-void rebalance_broker(void) {
-    pthread_mutex_lock (&instance->mutex);
+// Returns the shard with the shortest backlog per worker if this shard's one
+// exceeds it by more than SHARD_MIGRATION_THRESHOLD, and how many tasks to
+// hand over to it; NULL if the shards did not diverge
+static
+broker_shard_t _migration_needed(broker_shard_t shard, int *tasks_count);
+
+// Hands over tasks to another shard, the pending ones first
+static
+void _migrate_tasks(broker_shard_t shard, broker_shard_t target, int tasks_count);
+
+void rebalance_broker(broker_shard_t shard) {
+    int tasks_count = 0;
     
-    _rebalance_broker();
+    pthread_mutex_lock (&shard->mutex);
     
-    pthread_mutex_unlock (&instance->mutex);
+    _rebalance_broker(shard);
+    _publish_shard_backlog(shard);
     
-    dispatch_after(
-        dispatch_time(
-            DISPATCH_TIME_NOW,
-            (int64_t)(instance->rebalance_pace_in_seconds * NSEC_PER_SEC)
-        ),
-        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
-        ^(void) {
-            rebalance_broker();
-        }
-    );
+    broker_shard_t target = _migration_needed(shard, &tasks_count);
+    if (target) {
+        _migrate_tasks(shard, target, tasks_count);
+        _publish_shard_backlog(shard);
+    }
+    
+    // Relocated tasks might be waiting on an AVAILABLE worker now
+    notify_dispatcher(shard);
+    
+    pthread_mutex_unlock (&shard->mutex);
+    
+    // Never hold two shards' mutexes: the target's pass might be migrating
+    // tasks the other way
+    if (target) {
+        pthread_mutex_lock (&target->mutex);
+        notify_dispatcher(target);
+        pthread_mutex_unlock (&target->mutex);
+    }
+    
+    schedule_rebalance_broker(shard);
 }
 
 // Relocates all the tasks from the source worker to the destination worker
 static
-void _relocate_all_tasks(int src_worker_id, int dst_worker_id);
+void _relocate_all_tasks(broker_shard_t shard, int src_worker_id, int dst_worker_id);
 
 // Relocates some of the tasks from the source worker to the destination worker
 static
-void _relocate_some_tasks(int src_worker_id, int dst_worker_id);
+void _relocate_some_tasks(broker_shard_t shard, int src_worker_id, int dst_worker_id);
 
-void _rebalance_broker(void) {
-    // Workers load
-    static double snapshot[1024];
-    static int idle_candidates[1024], idle_count;
-    static int overload_candidates[1024], overload_count;
-    
+void _rebalance_broker(broker_shard_t shard) {
     int worker_id;
-    for (worker_id = 0; worker_id < instance->workers_count; worker_id++) {
-        worker_state_t worker_state = instance->worker_queue[worker_id];
-        snapshot[worker_id] = get_runtime_load(&worker_state->runtime);
-    }
-    
-    if (_relebance_needed(snapshot, instance->workers_count)) {
-        idle_count = 0;
-        overload_count = 0;
-        // Compute the IDLE and the overloaded candidates
-        for (worker_id = 0; worker_id < instance->workers_count; worker_id++) {
-            if (snapshot[worker_id] <= WORKER_IDLE_LOAD_THRESHOLD) {
-                idle_candidates[idle_count++] = worker_id;
-            } else if (snapshot[worker_id] >= WORKER_OVER_LOAD_THRESHOLD) {
-                overload_candidates[overload_count++] = worker_id;
-            }
+    
+    if (shard->snapshot_capacity < shard->workers.count) {
+        int capacity = shard->workers.capacity;
+        double *_snapshot = (double *) realloc(shard->snapshot, capacity * sizeof(double));
+        if (_snapshot) {
+            shard->snapshot = _snapshot;
+        }
+        int *_idle = (int *) realloc(shard->classes.idle, capacity * sizeof(int));
+        if (_idle) {
+            shard->classes.idle = _idle;
+        }
+        int *_overload = (int *) realloc(shard->classes.overload, capacity * sizeof(int));
+        if (_overload) {
+            shard->classes.overload = _overload;
+        }
+        if (!_snapshot || !_idle || !_overload) {
+            // Try again on the next round
+            return;
         }
+        shard->snapshot_capacity = capacity;
+    }
+    
+    double *snapshot = shard->snapshot;
+    
+    // Loads and IDLE / overloaded candidates, in one vectorized pass
+    worker_table_classify_loads(&shard->workers, snapshot, &shard->classes);
+    
+    if (_relebance_needed(&shard->classes)) {
+        int idle_count = shard->classes.idle_count;
+        int overload_count = shard->classes.overload_count;
+        int *idle_candidates = shard->classes.idle;
+        int *overload_candidates = shard->classes.overload;
         
         // Initially, relocate the IDLE and then the overloaded candidates
-        for (worker_id = 0; worker_id < 2 * instance->workers_count; worker_id++) {
+        for (worker_id = 0; worker_id < 2 * shard->workers.count; worker_id++) {
             int _worker_id = worker_id;
-            if (_worker_id >= instance->workers_count) {
-                _worker_id -= instance->workers_count;
+            if (_worker_id >= shard->workers.count) {
+                _worker_id -= shard->workers.count;
             }
             
             if (snapshot[_worker_id] > WORKER_IDLE_LOAD_THRESHOLD &&
                 snapshot[_worker_id] < WORKER_OVER_LOAD_THRESHOLD) {
                 if (idle_count > 0) {
-                    _relocate_all_tasks(idle_candidates[--idle_count], _worker_id);
+                    _relocate_all_tasks(shard, idle_candidates[--idle_count], _worker_id);
                 } else if (overload_count > 0) {
-                    _relocate_some_tasks(overload_candidates[--overload_count], _worker_id);
+                    _relocate_some_tasks(shard, overload_candidates[--overload_count], _worker_id);
                 } else {
                     break;
                 }
             } else if (snapshot[_worker_id] <= WORKER_IDLE_LOAD_THRESHOLD) {
                 if (overload_count > 0) {
-                    _relocate_some_tasks(overload_candidates[--overload_count], _worker_id);
+                    _relocate_some_tasks(shard, overload_candidates[--overload_count], _worker_id);
                 }
             }
         }
     }
 }
 
-int _relebance_needed(double *snapshot, int workers_count) {
-    int i;
-    int idle_candidates = 0, host_candidates = 0, split_candidates = 0;
-    for (i = 0; i < workers_count; i++) {
-        if (snapshot[i] <= WORKER_IDLE_LOAD_THRESHOLD) {
-            idle_candidates++;
-        } else if (snapshot[i] <= WORKER_ACCEPT_LOAD_THRESHOLD) {
-            host_candidates++;
-        } else if (snapshot[i] >= WORKER_OVER_LOAD_THRESHOLD) {
-            split_candidates++;
+int _relebance_needed(worker_load_classes_t *classes) {
+    return classes->overload_count > 0 &&
+        (classes->host_count > 0 || classes->idle_count > 0);
+}
+
+void _publish_shard_backlog(broker_shard_t shard) {
+    int backlog = 0, live_workers = 0, it;
+    
+    for (it = 0; it < shard->workers.count; it++) {
+        if (shard->workers.status[it] != DEAD) {
+            backlog += queue_get_size(shard->workers.states[it]->tasks);
+            live_workers++;
         }
     }
+    for (it = 0; it < instance->pending_classes; it++) {
+        backlog += queue_get_size(shard->pending_tasks[it]);
+    }
     
-    return split_candidates > 0 && (host_candidates > 0 || idle_candidates > 0);
+    atomic_store(&shard->backlog, backlog);
+    atomic_store(&shard->live_workers, live_workers);
 }
 
-static
-void _relocate_tasks_count(int src_worker_id, int dst_worker_id, unsigned int tasks_count) {
-    worker_state_t src_worker_state = instance->worker_queue[src_worker_id];
-    worker_state_t dst_worker_state = instance->worker_queue[dst_worker_id];
- 
-    while (tasks_count > 0) {
-        worker_task_t task = (worker_task_t) queue_get_key(src_worker_state->tasks);
-        queue_remove_key(src_worker_state->tasks, task, __pointer_compare);
-        queue_push(dst_worker_state->tasks, task);
+broker_shard_t _migration_needed(broker_shard_t shard, int *tasks_count) {
+    long backlog = atomic_load(&shard->backlog);
+    long workers = atomic_load(&shard->live_workers);
+    long target_backlog = 0, target_workers = 0;
+    broker_shard_t target = NULL;
+    int it;
+    
+    if (!workers) {
+        return NULL;
+    }
+    
+    for (it = 0; it < instance->shards_count; it++) {
+        broker_shard_t other = instance->shards[it];
+        long other_backlog = atomic_load(&other->backlog);
+        long other_workers = atomic_load(&other->live_workers);
         
-        tasks_count--;
+        if (other == shard || !other_workers) {
+            continue;
+        }
+        if (!target || other_backlog * target_workers < target_backlog * other_workers) {
+            target = other;
+            target_backlog = other_backlog;
+            target_workers = other_workers;
+        }
+    }
+    
+    // Compares the backlogs per worker without dividing
+    long excess = backlog * target_workers - target_backlog * workers;
+    if (!target || excess <= SHARD_MIGRATION_THRESHOLD * workers * target_workers) {
+        return NULL;
+    }
+    
+    // Enough tasks for both shards to end up with the same backlog per worker
+    *tasks_count = (int) (excess / (workers + target_workers));
+    
+    return target;
+}
+
+void _migrate_tasks(broker_shard_t shard, broker_shard_t target, int tasks_count) {
+    int moved = 0, size_class;
+    worker_task_t task;
+    
+    for (size_class = instance->pending_classes - 1; size_class >= 0; size_class--) {
+        while (moved < tasks_count &&
+            (task = (worker_task_t) queue_pop(shard->pending_tasks[size_class]))) {
+            queue_push(target->migrations, task);
+            moved++;
+        }
+    }
+    
+    while (moved < tasks_count) {
+        int worker_id = worker_index_most_backlogged(shard->worker_index);
+        if (worker_id == INVALID_WORKER_ID) {
+            break;
+        }
         
-        src_worker_state->runtime.assigned_tasks--;
+        task = worker_take_task(shard->workers.states[worker_id]);
+        reindex_worker(shard, worker_id);
+        if (!task) {
+            // A producer has not finished its push yet
+            break;
+        }
         
-        update_worker_runtime(&src_worker_state->runtime, task->request, -1);
-        update_worker_runtime(&dst_worker_state->runtime, task->request, 1);
+        queue_push(target->migrations, task);
+        moved++;
     }
+    
+    shard->migrated_tasks += moved;
+    
+    // The other passes see the tasks at their new place until the target's
+    // next pass publishes its own backlog
+    atomic_fetch_add(&target->backlog, moved);
+}
+
+static
+void _relocate_tasks_count(broker_shard_t shard, int src_worker_id, int dst_worker_id,
+    unsigned int tasks_count) {
+    relocate_worker_tasks(shard->workers.states[src_worker_id],
+        shard->workers.states[dst_worker_id],
+        tasks_count);
+    
+    reindex_worker(shard, src_worker_id);
+    reindex_worker(shard, dst_worker_id);
 }
 
-void _relocate_all_tasks(int src_worker_id, int dst_worker_id) {
-    _relocate_tasks_count(src_worker_id,
+void _relocate_all_tasks(broker_shard_t shard, int src_worker_id, int dst_worker_id) {
+    _relocate_tasks_count(shard, src_worker_id,
         dst_worker_id,
-        queue_get_size(instance->worker_queue[src_worker_id]->tasks));
+        queue_get_size(shard->workers.states[src_worker_id]->tasks));
 }
 
-void _relocate_some_tasks(int src_worker_id, int dst_worker_id) {
-    _relocate_tasks_count(src_worker_id,
+void _relocate_some_tasks(broker_shard_t shard, int src_worker_id, int dst_worker_id) {
+    _relocate_tasks_count(shard, src_worker_id,
         dst_worker_id,
-        (queue_get_size(instance->worker_queue[src_worker_id]->tasks) + 1) >> 1);
+        (queue_get_size(shard->workers.states[src_worker_id]->tasks) + 1) >> 1);
 }
@@ -25,7 +25,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <stdatomic.h>
 #include "queue.h"
 
 typedef struct __queue_t {
@@ -34,6 +36,17 @@ typedef struct __queue_t {
     unsigned int length;
     int dependencies_did_init;
     
+    /* Nodes allocator */
+    
+    // Number of nodes per slab, 0 if nodes are allocated one by one
+    unsigned int slab_nodes;
+    
+    // Allocated slabs, released when the queue is deleted
+    struct __queue_slab_t *slabs;
+    
+    // Recycled nodes, chained through their next pointer
+    struct __queue_node_t *free_nodes;
+    
     /* Callback functions */
 
     // Deletes the head of the queue
@@ -51,6 +64,24 @@ typedef struct __queue_t {
     
     // Iterates over a queue
     void (*iterate)(void *head, void (*iterator)(void *key));
+
+    // Returns the element to be removed next and its handle
+    void *(*peek)(queue_t q, queue_handle_t *handle);
+
+    // Removes the element identified by a handle; the head might be modified
+    int (*remove_handle)(queue_t q, queue_handle_t handle);
+    
+    // Returns the number of elements for queues that keep their own count,
+    // e.g. the concurrent ones; NULL if the length field is used instead
+    unsigned int (*size)(queue_t q);
+    
+    // Pushes several keys at once; NULL if they are pushed one by one
+    int (*push_batch)(queue_t q, void **keys, unsigned int count);
+    
+    // Moves up to count keys to a queue with the same policy; the length of
+    // both queues might be modified
+    unsigned int (*splice)(queue_t src, queue_t dst, unsigned int count,
+        void (*iterator)(void *key));
 } *_queue_t;
 
 /* Circular doubly linked list implementation */
@@ -60,6 +91,10 @@ static int rr_queue_remove_key(queue_t q, void *key,
     int (*compare)(void *key1, void *key2));
 static void *rr_queue_get_key(void *head, int index);
 static void rr_queue_iterate(void *head, void (*iterator)(void *key));
+static void *rr_queue_peek(queue_t q, queue_handle_t *handle);
+static int rr_queue_remove_handle(queue_t q, queue_handle_t handle);
+static unsigned int rr_queue_splice(queue_t src, queue_t dst,
+    unsigned int count, void (*iterator)(void *key));
 
 /* Array implementation */
 static void rnd_queue_delete(void *head);
@@ -68,12 +103,69 @@ static int rnd_queue_remove_key(queue_t q, void *key,
     int (*compare)(void *key1, void *key2));
 static void *rnd_queue_get_key(void *head, int index);
 static void rnd_queue_iterate(void *head, void (*iterator)(void *key));
+static void *rnd_queue_peek(queue_t q, queue_handle_t *handle);
+static int rnd_queue_remove_handle(queue_t q, queue_handle_t handle);
+static int rnd_queue_push_batch(queue_t q, void **keys, unsigned int count);
+static unsigned int rnd_queue_splice(queue_t src, queue_t dst,
+    unsigned int count, void (*iterator)(void *key));
+
+/* Lock-free multi-producer single-consumer list implementation */
+static void *mpsc_queue_new_head(void);
+static void mpsc_queue_delete(void *head);
+static int mpsc_queue_push(queue_t q, void *key);
+static void *mpsc_queue_get_key(void *head, int index);
+static void mpsc_queue_iterate(void *head, void (*iterator)(void *key));
+static void *mpsc_queue_peek(queue_t q, queue_handle_t *handle);
+static int mpsc_queue_remove_handle(queue_t q, queue_handle_t handle);
+static unsigned int mpsc_queue_size(queue_t q);
+static int mpsc_queue_push_batch(queue_t q, void **keys, unsigned int count);
+static unsigned int mpsc_queue_splice(queue_t src, queue_t dst,
+    unsigned int count, void (*iterator)(void *key));
+
+/* Lock-free single-producer single-consumer ring implementation */
+static void *spsc_queue_new_head(void);
+static void spsc_queue_delete(void *head);
+static int spsc_queue_push(queue_t q, void *key);
+static void *spsc_queue_get_key(void *head, int index);
+static void spsc_queue_iterate(void *head, void (*iterator)(void *key));
+static void *spsc_queue_peek(queue_t q, queue_handle_t *handle);
+static int spsc_queue_remove_handle(queue_t q, queue_handle_t handle);
+static unsigned int spsc_queue_size(queue_t q);
+static int spsc_queue_push_batch(queue_t q, void **keys, unsigned int count);
+
+/* 4-ary heap implementation */
+static void heap_queue_delete(void *head);
+static int heap_queue_push(queue_t q, void *key);
+static int heap_queue_push_priority(queue_t q, void *key, long priority);
+static int heap_queue_remove_key(queue_t q, void *key,
+    int (*compare)(void *key1, void *key2));
+static void *heap_queue_get_key(void *head, int index);
+static void heap_queue_iterate(void *head, void (*iterator)(void *key));
+static void *heap_queue_peek(queue_t q, queue_handle_t *handle);
+static int heap_queue_remove_handle(queue_t q, queue_handle_t handle);
+static unsigned int heap_queue_splice(queue_t src, queue_t dst,
+    unsigned int count, void (*iterator)(void *key));
+
+/* Moves keys one by one, for queues that cannot relink them */
+static unsigned int _queue_splice_keys(queue_t src, queue_t dst,
+    unsigned int count, void (*iterator)(void *key));
+
+/* Slab allocator used by the linked list implementation */
+static void queue_free_slabs(queue_t q);
 
 queue_t queue_new(balancing_policy_t balancing_policy) {
+    return queue_new_with_slab(balancing_policy, QUEUE_DEFAULT_SLAB_NODES);
+}
+
+queue_t queue_new_with_slab(balancing_policy_t balancing_policy,
+    unsigned int slab_nodes) {
     _queue_t result = NULL;
     
     if (balancing_policy != ROUND_ROBIN &&
         balancing_policy != RANDOM &&
+        balancing_policy != MPSC_FIFO &&
+        balancing_policy != PRIORITY &&
+        balancing_policy != SPSC_RING &&
         balancing_policy != USER_DEFINED) {
         return NULL;
     }
@@ -88,6 +180,13 @@ queue_t queue_new(balancing_policy_t balancing_policy) {
     result->head = NULL;
     result->length = 0;
     result->dependencies_did_init = 0;
+    result->slab_nodes = slab_nodes;
+    result->slabs = NULL;
+    result->free_nodes = NULL;
+    result->size = NULL;
+    result->push_batch = NULL;
+    result->splice = NULL;
+    queue_init(result, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
     
     if (balancing_policy == ROUND_ROBIN) {
         queue_init(result,
@@ -95,14 +194,66 @@ queue_t queue_new(balancing_policy_t balancing_policy) {
             rr_queue_push,
             rr_queue_remove_key,
             rr_queue_get_key,
-            rr_queue_iterate);
+            rr_queue_iterate,
+            rr_queue_peek,
+            rr_queue_remove_handle);
+        result->splice = rr_queue_splice;
     } else if (balancing_policy == RANDOM) {
         queue_init(result,
             rnd_queue_delete,
             rnd_queue_push,
             rnd_queue_remove_key,
             rnd_queue_get_key,
-            rnd_queue_iterate);
+            rnd_queue_iterate,
+            rnd_queue_peek,
+            rnd_queue_remove_handle);
+        result->push_batch = rnd_queue_push_batch;
+        result->splice = rnd_queue_splice;
+    } else if (balancing_policy == MPSC_FIFO) {
+        // Consumers may only remove the oldest element
+        queue_init(result,
+            mpsc_queue_delete,
+            mpsc_queue_push,
+            NULL,
+            mpsc_queue_get_key,
+            mpsc_queue_iterate,
+            mpsc_queue_peek,
+            mpsc_queue_remove_handle);
+        result->size = mpsc_queue_size;
+        result->push_batch = mpsc_queue_push_batch;
+        result->splice = mpsc_queue_splice;
+        result->head = mpsc_queue_new_head();
+        if (!result->head) {
+            free(result);
+            return NULL;
+        }
+    } else if (balancing_policy == PRIORITY) {
+        queue_init(result,
+            heap_queue_delete,
+            heap_queue_push,
+            heap_queue_remove_key,
+            heap_queue_get_key,
+            heap_queue_iterate,
+            heap_queue_peek,
+            heap_queue_remove_handle);
+        result->splice = heap_queue_splice;
+    } else if (balancing_policy == SPSC_RING) {
+        // Consumers may only remove the oldest element
+        queue_init(result,
+            spsc_queue_delete,
+            spsc_queue_push,
+            NULL,
+            spsc_queue_get_key,
+            spsc_queue_iterate,
+            spsc_queue_peek,
+            spsc_queue_remove_handle);
+        result->size = spsc_queue_size;
+        result->push_batch = spsc_queue_push_batch;
+        result->head = spsc_queue_new_head();
+        if (!result->head) {
+            free(result);
+            return NULL;
+        }
     } else if (balancing_policy == USER_DEFINED) {
         // To be filled by calling queue_init
     } else {
@@ -120,7 +271,9 @@ void queue_init(queue_t queue,
     int (*remove_key)(queue_t queue, void *key,
         int (*compare)(void *key1, void *key2)),
     void *(*get_key)(void *head, int index),
-    void (*iterate)(void *head, void (*iterator)(void *key))) {
+    void (*iterate)(void *head, void (*iterator)(void *key)),
+    void *(*peek)(queue_t queue, queue_handle_t *handle),
+    int (*remove_handle)(queue_t queue, queue_handle_t handle)) {
 
     _queue_t q = (_queue_t) queue;
     q->delete = delete;
@@ -128,6 +281,14 @@ void queue_init(queue_t queue,
     q->remove_key = remove_key;
     q->get_key = get_key;
     q->iterate = iterate;
+    q->peek = peek;
+    q->remove_handle = remove_handle;
+}
+
+/* Returns the number of elements in the queue */
+static
+unsigned int _queue_length(_queue_t q) {
+    return q->size ? q->size(q) : q->length;
 }
 
 void queue_delete(queue_t queue) {
@@ -137,7 +298,12 @@ void queue_delete(queue_t queue) {
     
     _queue_t q = (_queue_t) queue;
     
-    q->delete(q->head);
+    if (q->slabs) {
+        // Every node lives in a slab, so there is nothing to walk
+        queue_free_slabs(q);
+    } else if (q->delete) {
+        q->delete(q->head);
+    }
     
     q->length = 0;
     q->balancing_policy = 0;
@@ -146,6 +312,11 @@ void queue_delete(queue_t queue) {
     q->push = NULL;
     q->remove_key = NULL;
     q->iterate = NULL;
+    q->peek = NULL;
+    q->remove_handle = NULL;
+    q->size = NULL;
+    q->push_batch = NULL;
+    q->splice = NULL;
     
     free(queue);
 }
@@ -157,6 +328,24 @@ int queue_push(queue_t queue, void *key) {
     
     _queue_t q = (_queue_t) queue;
     int result = q->push(q, key);
+    if (!result && !q->size) {
+        q->length++;
+    }
+    
+    return result;
+}
+
+int queue_push_priority(queue_t queue, void *key, long priority) {
+    if (!queue) {
+        return NULL_POINTER_EXCEPTION;
+    }
+    
+    _queue_t q = (_queue_t) queue;
+    if (q->balancing_policy != PRIORITY) {
+        return queue_push(queue, key);
+    }
+    
+    int result = heap_queue_push_priority(q, key, priority);
     if (!result) {
         q->length++;
     }
@@ -164,16 +353,90 @@ int queue_push(queue_t queue, void *key) {
     return result;
 }
 
+int queue_push_batch(queue_t queue, void **keys, unsigned int count) {
+    if (!queue || (count && !keys)) {
+        return NULL_POINTER_EXCEPTION;
+    }
+    
+    _queue_t q = (_queue_t) queue;
+    
+    if (!q->push_batch) {
+        unsigned int i;
+        for (i = 0; i < count; i++) {
+            int result = queue_push(queue, keys[i]);
+            if (result) {
+                return result;
+            }
+        }
+        return SUCCESS;
+    }
+    
+    int result = q->push_batch(q, keys, count);
+    if (!result && !q->size) {
+        q->length += count;
+    }
+    
+    return result;
+}
+
+unsigned int queue_splice(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key)) {
+    _queue_t src_q = (_queue_t) src;
+    _queue_t dst_q = (_queue_t) dst;
+    
+    if (!src_q || !dst_q || src_q == dst_q || !src_q->head) {
+        return 0;
+    }
+    
+    unsigned int length = _queue_length(src_q);
+    if (count > length) {
+        count = length;
+    }
+    
+    if (!count) {
+        return 0;
+    }
+    
+    if (src_q->balancing_policy != dst_q->balancing_policy || !src_q->splice) {
+        return _queue_splice_keys(src, dst, count, iterator);
+    }
+    
+    return src_q->splice(src, dst, count, iterator);
+}
+
+unsigned int _queue_splice_keys(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key)) {
+    unsigned int moved = 0;
+    
+    while (moved < count) {
+        void *key = queue_pop(src);
+        if (!key) {
+            break;
+        }
+        if (queue_push(dst, key) != SUCCESS) {
+            // Keep the key where it was
+            queue_push(src, key);
+            break;
+        }
+        if (iterator) {
+            iterator(key);
+        }
+        moved++;
+    }
+    
+    return moved;
+}
+
 int queue_remove_key(queue_t queue, void *key,
     int (*compare)(void *key1, void *key2)) {
     
     _queue_t q = (_queue_t) queue;
     
-    if (!q || !q->head) {
+    if (!q || !q->head || !q->remove_key) {
         return NULL_POINTER_EXCEPTION;
     }
     
-    if (!q->length) {
+    if (!_queue_length(q)) {
         return EMPTY_QUEUE_EXCEPTION;
     }
     
@@ -183,7 +446,7 @@ int queue_remove_key(queue_t queue, void *key,
 void *queue_get_key(queue_t queue) {
     _queue_t q = (_queue_t) queue;
     
-    if (!q || !q->head || !q->length) {
+    if (!q || !q->head || !_queue_length(q)) {
         return NULL;
     }
     
@@ -200,6 +463,12 @@ void *queue_get_key(queue_t queue) {
         index = rand() % q->length;
     } else if (q->balancing_policy == ROUND_ROBIN) {
         
+    } else if (q->balancing_policy == MPSC_FIFO) {
+        
+    } else if (q->balancing_policy == SPSC_RING) {
+        
+    } else if (q->balancing_policy == PRIORITY) {
+        index = 0;
     } else {
         return NULL;
     }
@@ -207,12 +476,53 @@ void *queue_get_key(queue_t queue) {
     return q->get_key(q->head, index);
 }
 
+void *queue_peek(queue_t queue, queue_handle_t *handle) {
+    _queue_t q = (_queue_t) queue;
+    
+    if (!q || !q->head || !q->peek || !_queue_length(q)) {
+        return NULL;
+    }
+    
+    if (!q->dependencies_did_init) {
+        q->dependencies_did_init = 1;
+        srand(time(NULL));
+    }
+    
+    queue_handle_t unused;
+    return q->peek(q, handle ? handle : &unused);
+}
+
+int queue_remove_handle(queue_t queue, queue_handle_t handle) {
+    _queue_t q = (_queue_t) queue;
+    
+    if (!q || !q->head || !q->remove_handle) {
+        return NULL_POINTER_EXCEPTION;
+    }
+    
+    if (!_queue_length(q)) {
+        return EMPTY_QUEUE_EXCEPTION;
+    }
+    
+    return q->remove_handle(q, handle);
+}
+
+void *queue_pop(queue_t queue) {
+    queue_handle_t handle;
+    void *key = queue_peek(queue, &handle);
+    
+    if (key && queue_remove_handle(queue, handle) != SUCCESS) {
+        return NULL;
+    }
+    
+    return key;
+}
+
 void queue_iterate(queue_t queue, void (*iterator)(void *key)) {
     if (!queue || !iterator) {
         return;
     }
     _queue_t q = (_queue_t) queue;
-    if (q->length && q->head) {
+    if (_queue_length(q) && q->head) {
         q->iterate(q->head, iterator);
     }
 }
@@ -225,12 +535,71 @@ typedef struct __queue_node_t {
     struct __queue_node_t *next;
 } *queue_node_t;
 
+typedef struct __queue_slab_t {
+    struct __queue_slab_t *next;
+    struct __queue_node_t nodes[];
+} *queue_slab_t;
+
 typedef struct __array_queue_t {
-    void **data;      // Data allocated
-    long capacity;    // Total capacity of allocated data
+    void **data;      // Data allocated, used as a ring
+    long capacity;    // Total capacity of allocated data, a power of 2
+    long start;       // Slot of the first element in the ring
     long size;        // Current number of elements in the queue
 } *array_queue_t;
 
+static
+queue_node_t rr_node_alloc(_queue_t q) {
+    if (!q->slab_nodes) {
+        return (queue_node_t) malloc(sizeof(struct __queue_node_t));
+    }
+    
+    if (!q->free_nodes) {
+        queue_slab_t slab = (queue_slab_t) malloc(sizeof(struct __queue_slab_t) +
+            q->slab_nodes * sizeof(struct __queue_node_t));
+        if (!slab) {
+            return NULL;
+        }
+        
+        slab->next = q->slabs;
+        q->slabs = slab;
+        
+        unsigned int i;
+        for (i = 0; i < q->slab_nodes; i++) {
+            slab->nodes[i].next = q->free_nodes;
+            q->free_nodes = &slab->nodes[i];
+        }
+    }
+    
+    queue_node_t node = q->free_nodes;
+    q->free_nodes = node->next;
+    return node;
+}
+
+static
+void rr_node_free(_queue_t q, queue_node_t node) {
+    if (!q->slab_nodes) {
+        free(node);
+        return;
+    }
+    
+    node->next = q->free_nodes;
+    q->free_nodes = node;
+}
+
+void queue_free_slabs(queue_t queue) {
+    _queue_t q = (_queue_t) queue;
+    queue_slab_t slab = q->slabs;
+    
+    while (slab) {
+        queue_slab_t next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    
+    q->slabs = NULL;
+    q->free_nodes = NULL;
+}
+
 void rr_queue_delete(void *queue) {
     queue_node_t q = (queue_node_t) queue;
     if (!q) {
@@ -253,8 +622,7 @@ void rr_queue_delete(void *queue) {
 
 int rr_queue_push(queue_t queue, void *key) {
     _queue_t q = (_queue_t) queue;
-    queue_node_t new_node = (queue_node_t)
-        malloc(sizeof(struct __queue_node_t));
+    queue_node_t new_node = rr_node_alloc(q);
     
     if (!new_node) {
         return OUT_OF_MEMORY_EXCEPTION;
@@ -305,7 +673,7 @@ int rr_queue_remove_key(queue_t queue, void *key,
                 q->head = NULL;
             }
             
-            free(it);
+            rr_node_free(q, it);
             
             return SUCCESS;
         }
@@ -351,9 +719,264 @@ void rr_queue_iterate(void *q, void (*iterator)(void *key)) {
         }
     }
 }
+
+void *rr_queue_peek(queue_t queue, queue_handle_t *handle) {
+    _queue_t q = (_queue_t) queue;
+    queue_node_t head = (queue_node_t) q->head;
+    
+    // The oldest element is always the head of the list
+    *handle = head;
+    return head->key;
+}
+
+int rr_queue_remove_handle(queue_t queue, queue_handle_t handle) {
+    _queue_t q = (_queue_t) queue;
+    queue_node_t it = (queue_node_t) handle;
+    
+    if (!it) {
+        return NULL_POINTER_EXCEPTION;
+    }
+    
+    q->length--;
+    
+    if (q->length > 0) {
+        it->prev->next = it->next;
+        it->next->prev = it->prev;
+        if (q->head == it) {
+            q->head = it->next;
+        }
+    } else {
+        q->head = NULL;
+    }
+    
+    rr_node_free(q, it);
+    
+    return SUCCESS;
+}
+unsigned int rr_queue_splice(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key)) {
+    _queue_t src_q = (_queue_t) src;
+    _queue_t dst_q = (_queue_t) dst;
+    
+    // Cut the run [first, last] from the head of the source list
+    queue_node_t first = (queue_node_t) src_q->head;
+    queue_node_t last = first;
+    queue_node_t tail = first->prev;
+    queue_node_t rest;
+    unsigned int moved;
+    
+    if (src_q->slab_nodes || dst_q->slab_nodes) {
+        // Nodes belong to the slabs of the queue that allocated them: the keys
+        // move to the destination's nodes, which are linked as a single run
+        queue_node_t it = first;
+        first = last = NULL;
+        for (moved = 0; moved < count; moved++) {
+            queue_node_t node = rr_node_alloc(dst_q);
+            if (!node) {
+                break;
+            }
+            node->key = it->key;
+            if (iterator) {
+                iterator(it->key);
+            }
+            if (last) {
+                last->next = node;
+                node->prev = last;
+            } else {
+                first = node;
+            }
+            last = node;
+            
+            queue_node_t next = it->next;
+            rr_node_free(src_q, it);
+            it = next;
+        }
+        
+        if (!moved) {
+            return 0;
+        }
+        count = moved;
+        rest = it;
+    } else {
+        if (count == src_q->length && !iterator) {
+            last = tail;
+        } else {
+            for (moved = 1; ; moved++) {
+                if (iterator) {
+                    iterator(last->key);
+                }
+                if (moved == count) {
+                    break;
+                }
+                last = last->next;
+            }
+        }
+        rest = last->next;
+    }
+    
+    if (count == src_q->length) {
+        src_q->head = NULL;
+    } else {
+        tail->next = rest;
+        rest->prev = tail;
+        src_q->head = rest;
+    }
+    src_q->length -= count;
+    
+    // Append the run to the destination list
+    queue_node_t dst_head = (queue_node_t) dst_q->head;
+    if (!dst_head) {
+        first->prev = last;
+        last->next = first;
+        dst_q->head = first;
+    } else {
+        queue_node_t dst_tail = dst_head->prev;
+        dst_tail->next = first;
+        first->prev = dst_tail;
+        last->next = dst_head;
+        dst_head->prev = last;
+    }
+    dst_q->length += count;
+    
+    return count;
+}
 // Doubly linked list queue (circular)
 
 // Array
+#define ARRAY_QUEUE_MIN_CAPACITY 1024
+
+/* Returns the slot of the index-th element in the ring */
+static inline
+void **rnd_queue_slot(array_queue_t it, long index) {
+    return &it->data[(it->start + index) & (it->capacity - 1)];
+}
+
+/* Moves the elements to a ring of the given capacity, starting at slot 0 */
+static
+int rnd_queue_resize(array_queue_t it, long capacity) {
+    if (!it->start) {
+        // The elements are not wrapped, so realloc can move them in place
+        void **tmp = (void **) realloc(it->data, capacity * sizeof(void *));
+        if (!tmp) {
+            return OUT_OF_MEMORY_EXCEPTION;
+        }
+        it->data = tmp;
+        it->capacity = capacity;
+        return SUCCESS;
+    }
+    
+    void **data = (void **) malloc(capacity * sizeof(void *));
+    if (!data) {
+        return OUT_OF_MEMORY_EXCEPTION;
+    }
+    
+    // The elements occupy at most two runs: [start, capacity) and [0, ...)
+    long first_run = it->capacity - it->start;
+    if (first_run > it->size) {
+        first_run = it->size;
+    }
+    memcpy(data, it->data + it->start, first_run * sizeof(void *));
+    memcpy(data + first_run, it->data, (it->size - first_run) * sizeof(void *));
+    
+    free(it->data);
+    it->data = data;
+    it->capacity = capacity;
+    it->start = 0;
+    
+    return SUCCESS;
+}
+
+/* Halves the ring while it is at most a quarter full */
+static
+void rnd_queue_shrink(array_queue_t it) {
+    while (it->capacity > ARRAY_QUEUE_MIN_CAPACITY &&
+        it->size <= (it->capacity >> 2)) {
+        if (rnd_queue_resize(it, it->capacity >> 1) != SUCCESS) {
+            // Keep the larger ring
+            break;
+        }
+    }
+}
+
+/* Makes room for count more elements, doubling the ring as needed */
+static
+int rnd_queue_reserve(array_queue_t it, long count) {
+    long capacity = it->capacity;
+    while (capacity < it->size + count) {
+        capacity <<= 1;
+    }
+    return capacity == it->capacity ? SUCCESS : rnd_queue_resize(it, capacity);
+}
+
+/* Copies count elements from the src ring, starting at its from-th element,
+ * to the dst ring, starting at its to-th element, one contiguous run at a
+ * time; the iterator, if not NULL, is called for every copied element */
+static
+void rnd_queue_copy(array_queue_t src, long from, array_queue_t dst, long to,
+    long count, void (*iterator)(void *key)) {
+    while (count > 0) {
+        long src_slot = (src->start + from) & (src->capacity - 1);
+        long dst_slot = (dst->start + to) & (dst->capacity - 1);
+        long run = count;
+        if (run > src->capacity - src_slot) {
+            run = src->capacity - src_slot;
+        }
+        if (run > dst->capacity - dst_slot) {
+            run = dst->capacity - dst_slot;
+        }
+        
+        memcpy(dst->data + dst_slot, src->data + src_slot, run * sizeof(void *));
+        
+        if (iterator) {
+            long i;
+            for (i = 0; i < run; i++) {
+                iterator(dst->data[dst_slot + i]);
+            }
+        }
+        
+        from += run;
+        to += run;
+        count -= run;
+    }
+}
+
+/* Removes the index-th element: the first one by advancing the start of the
+ * ring, any other one by moving the last element in its slot; the ring is
+ * halved when it becomes a quarter full */
+static
+void rnd_queue_remove_index(_queue_t q, array_queue_t it, long index) {
+    if (index == 0) {
+        *rnd_queue_slot(it, 0) = NULL;
+        it->start = (it->start + 1) & (it->capacity - 1);
+    } else {
+        void **last = rnd_queue_slot(it, it->size - 1);
+        *rnd_queue_slot(it, index) = *last;
+        *last = NULL;
+    }
+    it->size--;
+    q->length--;
+    
+    rnd_queue_shrink(it);
+}
+
+/* Allocates an empty ring of ARRAY_QUEUE_MIN_CAPACITY slots */
+static
+array_queue_t rnd_queue_new_head(void) {
+    array_queue_t head = (array_queue_t) malloc(sizeof(struct __array_queue_t));
+    if (!head) {
+        return NULL;
+    }
+    head->capacity = ARRAY_QUEUE_MIN_CAPACITY;
+    head->start = 0;
+    head->size = 0;
+    head->data = (void **) malloc(head->capacity * sizeof(void *));
+    if (!head->data) {
+        free(head);
+        return NULL;
+    }
+    return head;
+}
+
 void rnd_queue_delete(void *head) {
     array_queue_t it = (array_queue_t) head;
     if (it) {
@@ -372,25 +995,21 @@ int rnd_queue_push(queue_t queue, void *key) {
     array_queue_t head = (array_queue_t) q->head;
     
     if (!head) {
-        head = (array_queue_t) malloc(sizeof(struct __array_queue_t));
-        head->capacity = 1024;
-        head->size = 0;
-        head->data = (void **) malloc(head->capacity * sizeof(void *));
+        head = rnd_queue_new_head();
+        if (!head) {
+            return OUT_OF_MEMORY_EXCEPTION;
+        }
         q->head = head;
     }
     
-    if (head->size >= head->capacity) {
-        head->capacity *= 2;
-        void **tmp = (void **) realloc(head->data, head->capacity * sizeof(void *));
-        if (!tmp) {
-            return OUT_OF_MEMORY_EXCEPTION;
-        }
-        head->data = tmp;
+    if (head->size >= head->capacity &&
+        rnd_queue_resize(head, head->capacity << 1) != SUCCESS) {
+        return OUT_OF_MEMORY_EXCEPTION;
     }
     
-    head->data[head->size++] = key;
+    *rnd_queue_slot(head, head->size++) = key;
 
-    return 0;
+    return SUCCESS;
 }
 
 int rnd_queue_remove_key(queue_t queue, void *key,
@@ -410,19 +1029,13 @@ int rnd_queue_remove_key(queue_t queue, void *key,
     
     long index;
     for (index = 0; index < head->size; index++) {
-        if (!compare(key, head->data[index])) {
-            while (index < head->size) {
-                head->data[index] = head->data[index + 1];
-                index++;
-            }
-            head->size--;
-            q->length--;
-            head->data[head->size] = NULL;
-            break;
+        if (!compare(key, *rnd_queue_slot(head, index))) {
+            rnd_queue_remove_index(q, head, index);
+            return SUCCESS;
         }
     }
 
-    return 0;
+    return KEY_NOT_FOUND_EXCEPTION;
 }
 
 void *rnd_queue_get_key(void *head, int index) {
@@ -430,7 +1043,7 @@ void *rnd_queue_get_key(void *head, int index) {
     if (!it || index < 0 || index >= it->size) {
         return NULL;
     }
-    return it->data[index];
+    return *rnd_queue_slot(it, index);
 }
 
 void rnd_queue_iterate(void *head, void (*iterator)(void *key)) {
@@ -442,31 +1055,850 @@ void rnd_queue_iterate(void *head, void (*iterator)(void *key)) {
     
     long index;
     for (index = 0; index < it->size; index++) {
-        iterator(it->data[index]);
+        iterator(*rnd_queue_slot(it, index));
     }
 }
 
-// Array
-#include <stdio.h>
-void print_pointers(void *key) {
-    printf("%p\n", key);
-}
-
-void queue_debug(queue_t queue) {
+int rnd_queue_push_batch(queue_t queue, void **keys, unsigned int count) {
     _queue_t q = (_queue_t) queue;
-    printf("DEBUG %p %p %d\n", q, q->head, q->length);
-    q->iterate(q->head, print_pointers);
+    array_queue_t head = (array_queue_t) q->head;
+    
+    if (!head) {
+        head = rnd_queue_new_head();
+        if (!head) {
+            return OUT_OF_MEMORY_EXCEPTION;
+        }
+        q->head = head;
+    }
+    
+    if (rnd_queue_reserve(head, count) != SUCCESS) {
+        return OUT_OF_MEMORY_EXCEPTION;
+    }
+    
+    // At most two runs, before and after the end of the ring
+    long copied = 0;
+    while (copied < count) {
+        long slot = (head->start + head->size) & (head->capacity - 1);
+        long run = count - copied;
+        if (run > head->capacity - slot) {
+            run = head->capacity - slot;
+        }
+        memcpy(head->data + slot, keys + copied, run * sizeof(void *));
+        head->size += run;
+        copied += run;
+    }
+    
+    return SUCCESS;
 }
 
-float execute_task(void (*task)(void)) {
-    clock_t start = clock();
-    task();
-    clock_t end = clock();
-    float seconds = (float)(end - start) / CLOCKS_PER_SEC;
-    return seconds;
+unsigned int rnd_queue_splice(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key)) {
+    _queue_t src_q = (_queue_t) src;
+    _queue_t dst_q = (_queue_t) dst;
+    array_queue_t src_head = (array_queue_t) src_q->head;
+    array_queue_t dst_head = (array_queue_t) dst_q->head;
+    
+    if (!dst_head) {
+        dst_head = rnd_queue_new_head();
+        if (!dst_head) {
+            return 0;
+        }
+        dst_q->head = dst_head;
+    }
+    
+    if (rnd_queue_reserve(dst_head, count) != SUCCESS) {
+        return 0;
+    }
+    
+    // The newest elements leave, so the source ring keeps its start
+    rnd_queue_copy(src_head, src_head->size - count,
+        dst_head, dst_head->size, count, iterator);
+    
+    src_head->size -= count;
+    src_q->length -= count;
+    dst_head->size += count;
+    dst_q->length += count;
+    
+    rnd_queue_shrink(src_head);
+    
+    return count;
+}
+
+void *rnd_queue_peek(queue_t queue, queue_handle_t *handle) {
+    _queue_t q = (_queue_t) queue;
+    array_queue_t head = (array_queue_t) q->head;
+    long index = rand() % head->size;
+    
+    *handle = (queue_handle_t) index;
+    return *rnd_queue_slot(head, index);
+}
+
+int rnd_queue_remove_handle(queue_t queue, queue_handle_t handle) {
+    _queue_t q = (_queue_t) queue;
+    array_queue_t head = (array_queue_t) q->head;
+    long index = (long) handle;
+    
+    if (index < 0 || index >= head->size) {
+        return KEY_NOT_FOUND_EXCEPTION;
+    }
+    
+    rnd_queue_remove_index(q, head, index);
+    
+    return SUCCESS;
+}
+
+// Array
+
+// Lock-free multi-producer single-consumer list
+//
+// Producers append by swapping the tail pointer and then linking the previous
+// tail to the new node. The consumer owns a stub node that precedes the oldest
+// element; removing an element turns its node into the new stub. A producer
+// that swapped the tail but did not link it yet makes the queue look empty to
+// the consumer for a moment, which is harmless for a dispatcher that retries.
+typedef struct __mpsc_node_t {
+    void *key;
+    struct __mpsc_node_t *_Atomic next;
+} *mpsc_node_t;
+
+typedef struct __mpsc_queue_t {
+    // Last node, shared by all the producers
+    _Atomic(mpsc_node_t) tail;
+    char tail_padding[64 - sizeof(mpsc_node_t)];
+    
+    // Stub node preceding the oldest element, owned by the consumer
+    mpsc_node_t head;
+    char head_padding[64 - sizeof(mpsc_node_t)];
+    
+    // Number of elements, incremented before a node becomes visible
+    atomic_uint size;
+} *mpsc_queue_t;
+
+void *mpsc_queue_new_head(void) {
+    mpsc_queue_t head = (mpsc_queue_t) malloc(sizeof(struct __mpsc_queue_t));
+    mpsc_node_t stub = (mpsc_node_t) malloc(sizeof(struct __mpsc_node_t));
+    
+    if (!head || !stub) {
+        free(head);
+        free(stub);
+        return NULL;
+    }
+    
+    stub->key = NULL;
+    atomic_init(&stub->next, NULL);
+    atomic_init(&head->tail, stub);
+    atomic_init(&head->size, 0);
+    head->head = stub;
+    
+    return head;
+}
+
+void mpsc_queue_delete(void *queue) {
+    mpsc_queue_t head = (mpsc_queue_t) queue;
+    if (!head) {
+        return;
+    }
+    
+    mpsc_node_t it = head->head;
+    while (it) {
+        mpsc_node_t next = atomic_load_explicit(&it->next, memory_order_relaxed);
+        free(it);
+        it = next;
+    }
+    
+    free(head);
+}
+
+int mpsc_queue_push(queue_t queue, void *key) {
+    _queue_t q = (_queue_t) queue;
+    mpsc_queue_t head = (mpsc_queue_t) q->head;
+    mpsc_node_t new_node = (mpsc_node_t) malloc(sizeof(struct __mpsc_node_t));
+    
+    if (!new_node) {
+        return OUT_OF_MEMORY_EXCEPTION;
+    }
+    
+    new_node->key = key;
+    atomic_store_explicit(&new_node->next, NULL, memory_order_relaxed);
+    
+    atomic_fetch_add_explicit(&head->size, 1, memory_order_relaxed);
+    
+    mpsc_node_t prev = atomic_exchange_explicit(&head->tail, new_node,
+        memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, new_node, memory_order_release);
+    
+    return SUCCESS;
+}
+
+void *mpsc_queue_get_key(void *queue, int index) {
+    mpsc_queue_t head = (mpsc_queue_t) queue;
+    (void) index;   // Only the oldest key is returned, whatever the index
+    mpsc_node_t next = atomic_load_explicit(&head->head->next,
+        memory_order_acquire);
+    
+    return next ? next->key : NULL;
+}
+
+void mpsc_queue_iterate(void *queue, void (*iterator)(void *key)) {
+    mpsc_queue_t head = (mpsc_queue_t) queue;
+    mpsc_node_t it = atomic_load_explicit(&head->head->next,
+        memory_order_acquire);
+    
+    while (it) {
+        iterator(it->key);
+        it = atomic_load_explicit(&it->next, memory_order_acquire);
+    }
+}
+
+void *mpsc_queue_peek(queue_t queue, queue_handle_t *handle) {
+    _queue_t q = (_queue_t) queue;
+    mpsc_queue_t head = (mpsc_queue_t) q->head;
+    mpsc_node_t next = atomic_load_explicit(&head->head->next,
+        memory_order_acquire);
+    
+    if (!next) {
+        return NULL;
+    }
+    
+    *handle = next;
+    return next->key;
+}
+
+int mpsc_queue_remove_handle(queue_t queue, queue_handle_t handle) {
+    _queue_t q = (_queue_t) queue;
+    mpsc_queue_t head = (mpsc_queue_t) q->head;
+    mpsc_node_t stub = head->head;
+    mpsc_node_t next = atomic_load_explicit(&stub->next, memory_order_acquire);
+    
+    if (!next || next != handle) {
+        // Only the oldest element can be removed
+        return KEY_NOT_FOUND_EXCEPTION;
+    }
+    
+    head->head = next;
+    next->key = NULL;
+    free(stub);
+    
+    atomic_fetch_sub_explicit(&head->size, 1, memory_order_relaxed);
+    
+    return SUCCESS;
+}
+
+unsigned int mpsc_queue_size(queue_t queue) {
+    _queue_t q = (_queue_t) queue;
+    mpsc_queue_t head = (mpsc_queue_t) q->head;
+    return atomic_load_explicit(&head->size, memory_order_relaxed);
+}
+
+int mpsc_queue_push_batch(queue_t queue, void **keys, unsigned int count) {
+    _queue_t q = (_queue_t) queue;
+    mpsc_queue_t head = (mpsc_queue_t) q->head;
+    mpsc_node_t first = NULL, last = NULL;
+    unsigned int i;
+    
+    if (!count) {
+        return SUCCESS;
+    }
+    
+    // Build a private chain, then publish it with a single exchange
+    for (i = 0; i < count; i++) {
+        mpsc_node_t new_node = (mpsc_node_t) malloc(sizeof(struct __mpsc_node_t));
+        if (!new_node) {
+            while (first) {
+                mpsc_node_t next = atomic_load_explicit(&first->next,
+                    memory_order_relaxed);
+                free(first);
+                first = next;
+            }
+            return OUT_OF_MEMORY_EXCEPTION;
+        }
+        new_node->key = keys[i];
+        atomic_store_explicit(&new_node->next, NULL, memory_order_relaxed);
+        if (last) {
+            atomic_store_explicit(&last->next, new_node, memory_order_relaxed);
+        } else {
+            first = new_node;
+        }
+        last = new_node;
+    }
+    
+    atomic_fetch_add_explicit(&head->size, count, memory_order_relaxed);
+    
+    mpsc_node_t prev = atomic_exchange_explicit(&head->tail, last,
+        memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, first, memory_order_release);
+    
+    return SUCCESS;
+}
+
+unsigned int mpsc_queue_splice(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key)) {
+    mpsc_queue_t src_head = (mpsc_queue_t) ((_queue_t) src)->head;
+    mpsc_queue_t dst_head = (mpsc_queue_t) ((_queue_t) dst)->head;
+    
+    // Every key moves one node back, so the run starts at the source's stub
+    // and the node of the last moved key becomes the source's new stub
+    mpsc_node_t first = src_head->head, last = NULL, it = first;
+    unsigned int moved = 0;
+    
+    while (moved < count) {
+        mpsc_node_t next = atomic_load_explicit(&it->next, memory_order_acquire);
+        if (!next) {
+            // A producer did not link its node yet
+            break;
+        }
+        it->key = next->key;
+        if (iterator) {
+            iterator(it->key);
+        }
+        last = it;
+        it = next;
+        moved++;
+    }
+    
+    if (!moved) {
+        return 0;
+    }
+    
+    it->key = NULL;
+    src_head->head = it;
+    atomic_fetch_sub_explicit(&src_head->size, moved, memory_order_relaxed);
+    
+    // The run is private now, publish it as a batch of new nodes
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+    atomic_fetch_add_explicit(&dst_head->size, moved, memory_order_relaxed);
+    
+    mpsc_node_t prev = atomic_exchange_explicit(&dst_head->tail, last,
+        memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, first, memory_order_release);
+    
+    return moved;
+}
+
+// Lock-free multi-producer single-consumer list
+
+// 4-ary heap
+//
+// The entries are stored by value, so comparing siblings does not chase the
+// keys' pointers and the 4 children of a node share one or two cache lines.
+#define HEAP_QUEUE_ARITY         4
+#define HEAP_QUEUE_MIN_CAPACITY  1024
+
+typedef struct __heap_entry_t {
+    long priority;
+    unsigned long sequence;   // Push order, to break priority ties
+    void *key;
+} heap_entry_t;
+
+typedef struct __heap_queue_t {
+    heap_entry_t *data;
+    long capacity;
+    long size;
+    unsigned long sequence;
+} *heap_queue_t;
+
+/* Returns 1 if the first entry has to be removed before the second one */
+static inline
+int heap_entry_before(heap_entry_t *entry1, heap_entry_t *entry2) {
+    return entry1->priority < entry2->priority ||
+        (entry1->priority == entry2->priority &&
+            entry1->sequence < entry2->sequence);
+}
+
+static
+void heap_queue_sift_up(heap_queue_t it, long index) {
+    heap_entry_t entry = it->data[index];
+    
+    while (index > 0) {
+        long parent = (index - 1) / HEAP_QUEUE_ARITY;
+        if (!heap_entry_before(&entry, &it->data[parent])) {
+            break;
+        }
+        it->data[index] = it->data[parent];
+        index = parent;
+    }
+    
+    it->data[index] = entry;
+}
+
+static
+void heap_queue_sift_down(heap_queue_t it, long index) {
+    heap_entry_t entry = it->data[index];
+    
+    while (1) {
+        long first_child = index * HEAP_QUEUE_ARITY + 1;
+        if (first_child >= it->size) {
+            break;
+        }
+        
+        long last_child = first_child + HEAP_QUEUE_ARITY;
+        if (last_child > it->size) {
+            last_child = it->size;
+        }
+        
+        long best = first_child, child;
+        for (child = first_child + 1; child < last_child; child++) {
+            if (heap_entry_before(&it->data[child], &it->data[best])) {
+                best = child;
+            }
+        }
+        
+        if (!heap_entry_before(&it->data[best], &entry)) {
+            break;
+        }
+        it->data[index] = it->data[best];
+        index = best;
+    }
+    
+    it->data[index] = entry;
+}
+
+static
+int heap_queue_resize(heap_queue_t it, long capacity) {
+    heap_entry_t *tmp = (heap_entry_t *) realloc(it->data,
+        capacity * sizeof(heap_entry_t));
+    if (!tmp) {
+        return OUT_OF_MEMORY_EXCEPTION;
+    }
+    it->data = tmp;
+    it->capacity = capacity;
+    return SUCCESS;
+}
+
+/* Halves the heap while it is at most a quarter full */
+static
+void heap_queue_shrink(heap_queue_t it) {
+    while (it->capacity > HEAP_QUEUE_MIN_CAPACITY &&
+        it->size <= (it->capacity >> 2)) {
+        if (heap_queue_resize(it, it->capacity >> 1) != SUCCESS) {
+            // Keep the larger heap
+            break;
+        }
+    }
+}
+
+/* Removes the index-th entry by moving the last entry in its slot and
+ * restoring the heap order; the heap is halved when it becomes a quarter
+ * full */
+static
+void heap_queue_remove_index(_queue_t q, heap_queue_t it, long index) {
+    it->size--;
+    q->length--;
+    
+    if (index < it->size) {
+        it->data[index] = it->data[it->size];
+        heap_queue_sift_down(it, index);
+        heap_queue_sift_up(it, index);
+    }
+    
+    heap_queue_shrink(it);
+}
+
+/* Allocates an empty heap of HEAP_QUEUE_MIN_CAPACITY entries */
+static
+heap_queue_t heap_queue_new_head(void) {
+    heap_queue_t head = (heap_queue_t) malloc(sizeof(struct __heap_queue_t));
+    if (!head) {
+        return NULL;
+    }
+    head->capacity = HEAP_QUEUE_MIN_CAPACITY;
+    head->size = 0;
+    head->sequence = 0;
+    head->data = (heap_entry_t *) malloc(head->capacity * sizeof(heap_entry_t));
+    if (!head->data) {
+        free(head);
+        return NULL;
+    }
+    return head;
+}
+
+void heap_queue_delete(void *head) {
+    heap_queue_t it = (heap_queue_t) head;
+    if (it) {
+        free(it->data);
+    }
+    free(head);
+}
+
+int heap_queue_push(queue_t queue, void *key) {
+    return heap_queue_push_priority(queue, key, QUEUE_DEFAULT_PRIORITY);
+}
+
+int heap_queue_push_priority(queue_t queue, void *key, long priority) {
+    _queue_t q = (_queue_t) queue;
+    heap_queue_t head = (heap_queue_t) q->head;
+    
+    if (!head) {
+        head = heap_queue_new_head();
+        if (!head) {
+            return OUT_OF_MEMORY_EXCEPTION;
+        }
+        q->head = head;
+    }
+    
+    if (head->size >= head->capacity &&
+        heap_queue_resize(head, head->capacity << 1) != SUCCESS) {
+        return OUT_OF_MEMORY_EXCEPTION;
+    }
+    
+    heap_entry_t *entry = &head->data[head->size];
+    entry->priority = priority;
+    entry->sequence = head->sequence++;
+    entry->key = key;
+    heap_queue_sift_up(head, head->size++);
+    
+    return SUCCESS;
+}
+
+int heap_queue_remove_key(queue_t queue, void *key,
+    int (*compare)(void *key1, void *key2)) {
+    
+    _queue_t q = (_queue_t) queue;
+    heap_queue_t head = (heap_queue_t) q->head;
+    
+    if (!head) {
+        return NULL_POINTER_EXCEPTION;
+    }
+    
+    long index;
+    for (index = 0; index < head->size; index++) {
+        if (!compare(key, head->data[index].key)) {
+            heap_queue_remove_index(q, head, index);
+            return SUCCESS;
+        }
+    }
+    
+    return KEY_NOT_FOUND_EXCEPTION;
+}
+
+void *heap_queue_get_key(void *head, int index) {
+    heap_queue_t it = (heap_queue_t) head;
+    if (!it || index < 0 || index >= it->size) {
+        return NULL;
+    }
+    return it->data[index].key;
+}
+
+void heap_queue_iterate(void *head, void (*iterator)(void *key)) {
+    heap_queue_t it = (heap_queue_t) head;
+    
+    if (!it) {
+        return;
+    }
+    
+    long index;
+    for (index = 0; index < it->size; index++) {
+        iterator(it->data[index].key);
+    }
+}
+
+void *heap_queue_peek(queue_t queue, queue_handle_t *handle) {
+    _queue_t q = (_queue_t) queue;
+    heap_queue_t head = (heap_queue_t) q->head;
+    
+    *handle = (queue_handle_t) 0L;
+    return head->data[0].key;
+}
+
+int heap_queue_remove_handle(queue_t queue, queue_handle_t handle) {
+    _queue_t q = (_queue_t) queue;
+    heap_queue_t head = (heap_queue_t) q->head;
+    long index = (long) handle;
+    
+    if (index < 0 || index >= head->size) {
+        return KEY_NOT_FOUND_EXCEPTION;
+    }
+    
+    heap_queue_remove_index(q, head, index);
+    
+    return SUCCESS;
+}
+
+unsigned int heap_queue_splice(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key)) {
+    _queue_t src_q = (_queue_t) src;
+    _queue_t dst_q = (_queue_t) dst;
+    heap_queue_t src_head = (heap_queue_t) src_q->head;
+    heap_queue_t dst_head = (heap_queue_t) dst_q->head;
+    
+    if (!dst_head) {
+        dst_head = heap_queue_new_head();
+        if (!dst_head) {
+            return 0;
+        }
+        dst_q->head = dst_head;
+    }
+    
+    long capacity = dst_head->capacity;
+    while (capacity < dst_head->size + count) {
+        capacity <<= 1;
+    }
+    if (capacity != dst_head->capacity &&
+        heap_queue_resize(dst_head, capacity) != SUCCESS) {
+        return 0;
+    }
+    
+    // The last entries of the array are leaves, so cutting them off keeps the
+    // source a valid heap. A leaf is only ordered after its ancestors, so the
+    // moved keys can be of any urgency, the source's next one excepted
+    long first = src_head->size - count;
+    memcpy(dst_head->data + dst_head->size, src_head->data + first,
+        count * sizeof(heap_entry_t));
+    
+    // The moved keys are numbered after the destination's, in array order:
+    // among equal priorities, they lose the order they were pushed in
+    long index;
+    for (index = dst_head->size; index < dst_head->size + count; index++) {
+        dst_head->data[index].sequence = dst_head->sequence++;
+        if (iterator) {
+            iterator(dst_head->data[index].key);
+        }
+    }
+    
+    // Sift the new entries up in the order they were appended
+    for (index = dst_head->size; index < dst_head->size + count; index++) {
+        heap_queue_sift_up(dst_head, index);
+    }
+    
+    src_head->size = first;
+    src_q->length -= count;
+    dst_head->size += count;
+    dst_q->length += count;
+    
+    heap_queue_shrink(src_head);
+    
+    return count;
+}
+
+// 4-ary heap
+
+// Lock-free single-producer single-consumer ring
+//
+// The ring is a chain of fixed-size chunks, so it never fills up: the
+// producer links a new chunk when the last one is full and the consumer frees
+// a chunk once it read all of its slots. Each side owns its own position; the
+// producer publishes elements by advancing the pushed counter and the consumer
+// releases them by advancing the popped counter.
+#define SPSC_CHUNK_SLOTS 256
+
+typedef struct __spsc_chunk_t {
+    void *slots[SPSC_CHUNK_SLOTS];
+    struct __spsc_chunk_t *_Atomic next;
+} *spsc_chunk_t;
+
+typedef struct __spsc_queue_t {
+    // Owned by the producer
+    spsc_chunk_t tail;
+    unsigned int tail_slot;
+    atomic_uint pushed;
+    char tail_padding[64 - sizeof(spsc_chunk_t) - 2 * sizeof(unsigned int)];
+    
+    // Owned by the consumer
+    spsc_chunk_t head;
+    unsigned int head_slot;
+    atomic_uint popped;
+    char head_padding[64 - sizeof(spsc_chunk_t) - 2 * sizeof(unsigned int)];
+} *spsc_queue_t;
+
+static
+spsc_chunk_t spsc_chunk_new(void) {
+    spsc_chunk_t chunk = (spsc_chunk_t) malloc(sizeof(struct __spsc_chunk_t));
+    if (chunk) {
+        atomic_init(&chunk->next, NULL);
+    }
+    return chunk;
+}
+
+void *spsc_queue_new_head(void) {
+    spsc_queue_t head = (spsc_queue_t) malloc(sizeof(struct __spsc_queue_t));
+    spsc_chunk_t chunk = spsc_chunk_new();
+    
+    if (!head || !chunk) {
+        free(head);
+        free(chunk);
+        return NULL;
+    }
+    
+    head->tail = head->head = chunk;
+    head->tail_slot = head->head_slot = 0;
+    atomic_init(&head->pushed, 0);
+    atomic_init(&head->popped, 0);
+    
+    return head;
+}
+
+void spsc_queue_delete(void *queue) {
+    spsc_queue_t head = (spsc_queue_t) queue;
+    if (!head) {
+        return;
+    }
+    
+    spsc_chunk_t it = head->head;
+    while (it) {
+        spsc_chunk_t next = atomic_load_explicit(&it->next, memory_order_relaxed);
+        free(it);
+        it = next;
+    }
+    
+    free(head);
+}
+
+/* Stores a key in the producer's next slot, without publishing it */
+static inline
+int spsc_queue_store(spsc_queue_t head, void *key) {
+    if (head->tail_slot == SPSC_CHUNK_SLOTS) {
+        spsc_chunk_t chunk = spsc_chunk_new();
+        if (!chunk) {
+            return OUT_OF_MEMORY_EXCEPTION;
+        }
+        // Published along with the first key stored in the new chunk
+        atomic_store_explicit(&head->tail->next, chunk, memory_order_relaxed);
+        head->tail = chunk;
+        head->tail_slot = 0;
+    }
+    
+    head->tail->slots[head->tail_slot++] = key;
+    return SUCCESS;
+}
+
+int spsc_queue_push(queue_t queue, void *key) {
+    spsc_queue_t head = (spsc_queue_t) ((_queue_t) queue)->head;
+    
+    int result = spsc_queue_store(head, key);
+    if (result == SUCCESS) {
+        atomic_store_explicit(&head->pushed,
+            atomic_load_explicit(&head->pushed, memory_order_relaxed) + 1,
+            memory_order_release);
+    }
+    
+    return result;
+}
+
+int spsc_queue_push_batch(queue_t queue, void **keys, unsigned int count) {
+    spsc_queue_t head = (spsc_queue_t) ((_queue_t) queue)->head;
+    unsigned int stored = 0;
+    int result = SUCCESS;
+    
+    while (stored < count &&
+        (result = spsc_queue_store(head, keys[stored])) == SUCCESS) {
+        stored++;
+    }
+    
+    // The stored keys become visible at once
+    atomic_store_explicit(&head->pushed,
+        atomic_load_explicit(&head->pushed, memory_order_relaxed) + stored,
+        memory_order_release);
+    
+    return result;
+}
+
+/* Returns the consumer's next slot, moving to the next chunk if needed; the
+ * caller checked that the ring is not empty */
+static
+void **spsc_queue_head_slot(spsc_queue_t head) {
+    if (head->head_slot == SPSC_CHUNK_SLOTS) {
+        spsc_chunk_t next = atomic_load_explicit(&head->head->next,
+            memory_order_relaxed);
+        free(head->head);
+        head->head = next;
+        head->head_slot = 0;
+    }
+    
+    return &head->head->slots[head->head_slot];
+}
+
+static inline
+unsigned int spsc_queue_available(spsc_queue_t head) {
+    return atomic_load_explicit(&head->pushed, memory_order_acquire) -
+        atomic_load_explicit(&head->popped, memory_order_relaxed);
+}
+
+void *spsc_queue_get_key(void *queue, int index) {
+    spsc_queue_t head = (spsc_queue_t) queue;
+    (void) index;   // Only the oldest key is returned, whatever the index
+    
+    if (!spsc_queue_available(head)) {
+        return NULL;
+    }
+    
+    return *spsc_queue_head_slot(head);
+}
+
+void spsc_queue_iterate(void *queue, void (*iterator)(void *key)) {
+    spsc_queue_t head = (spsc_queue_t) queue;
+    unsigned int count = spsc_queue_available(head);
+    spsc_chunk_t chunk = head->head;
+    unsigned int slot = head->head_slot;
+    
+    while (count--) {
+        if (slot == SPSC_CHUNK_SLOTS) {
+            chunk = atomic_load_explicit(&chunk->next, memory_order_relaxed);
+            slot = 0;
+        }
+        iterator(chunk->slots[slot++]);
+    }
+}
+
+void *spsc_queue_peek(queue_t queue, queue_handle_t *handle) {
+    spsc_queue_t head = (spsc_queue_t) ((_queue_t) queue)->head;
+    
+    if (!spsc_queue_available(head)) {
+        return NULL;
+    }
+    
+    void **slot = spsc_queue_head_slot(head);
+    *handle = slot;
+    return *slot;
+}
+
+int spsc_queue_remove_handle(queue_t queue, queue_handle_t handle) {
+    spsc_queue_t head = (spsc_queue_t) ((_queue_t) queue)->head;
+    
+    if (!spsc_queue_available(head) || handle != spsc_queue_head_slot(head)) {
+        // Only the oldest element can be removed
+        return KEY_NOT_FOUND_EXCEPTION;
+    }
+    
+    head->head_slot++;
+    atomic_store_explicit(&head->popped,
+        atomic_load_explicit(&head->popped, memory_order_relaxed) + 1,
+        memory_order_release);
+    
+    return SUCCESS;
+}
+
+unsigned int spsc_queue_size(queue_t queue) {
+    spsc_queue_t head = (spsc_queue_t) ((_queue_t) queue)->head;
+    return atomic_load_explicit(&head->pushed, memory_order_relaxed) -
+        atomic_load_explicit(&head->popped, memory_order_relaxed);
+}
+// Lock-free single-producer single-consumer ring
+
+#include <stdio.h>
+void print_pointers(void *key) {
+    printf("%p\n", key);
+}
+
+void queue_debug(queue_t queue) {
+    _queue_t q = (_queue_t) queue;
+    printf("DEBUG %p %p %d\n", q, q->head, _queue_length(q));
+    q->iterate(q->head, print_pointers);
+}
+
+float execute_task(void (*task)(void)) {
+    clock_t start = clock();
+    task();
+    clock_t end = clock();
+    float seconds = (float)(end - start) / CLOCKS_PER_SEC;
+    return seconds;
 }
 
 unsigned int queue_get_size(queue_t queue) {
     _queue_t q = (_queue_t) queue;
-    return !q ? -1 : q->length;
+    return !q ? -1 : _queue_length(q);
+}
+
+balancing_policy_t queue_get_balancing_policy(queue_t queue) {
+    _queue_t q = (_queue_t) queue;
+    return q->balancing_policy;
 }
@@ -27,9 +27,20 @@
 #ifndef broker_impl_queue_h
 #define broker_impl_queue_h
 
+#include <limits.h>
+
 typedef enum {
     RANDOM,
     ROUND_ROBIN,
+    /* FIFO queue that accepts concurrent pushes from any number of threads
+     * without locking, while a single thread at a time peeks and removes */
+    MPSC_FIFO,
+    /* 4-ary min-heap that always returns the key with the lowest priority
+     * value, in FIFO order for equal priorities */
+    PRIORITY,
+    /* FIFO queue for exactly one producer thread and one consumer thread,
+     * without locking and without an allocation per element */
+    SPSC_RING,
     USER_DEFINED
 } balancing_policy_t;
 
@@ -44,9 +55,26 @@ typedef enum {
 
 typedef void *queue_t;
 
+/* Identifies an element inside a queue; a handle is only valid until the next
+ * push or remove operation on the same queue */
+typedef void *queue_handle_t;
+
+/* Number of nodes carved out of every slab allocated by a ROUND_ROBIN queue */
+#define QUEUE_DEFAULT_SLAB_NODES        256
+
+/* Priority of the keys pushed without an explicit priority; they are returned
+ * after all the keys that have one */
+#define QUEUE_DEFAULT_PRIORITY          LONG_MAX
+
 /* Creates a new queue */
 queue_t queue_new(balancing_policy_t balancing_policy);
 
+/* Creates a new queue whose nodes are allocated in slabs of slab_nodes
+ * elements and recycled through a freelist; 0 allocates every node with
+ * malloc. Only the ROUND_ROBIN queue allocates nodes. */
+queue_t queue_new_with_slab(balancing_policy_t balancing_policy,
+    unsigned int slab_nodes);
+
 /* Initializes the callback function for a queue with USER_DEFINED scheduling
  * policy */
 void queue_init(queue_t queue,
@@ -55,7 +83,9 @@ void queue_init(queue_t queue,
     int (*remove_key)(queue_t queue, void *key,
         int (*compare)(void *key1, void *key2)),
     void *(*get_key)(void *head, int index),
-    void (*iterate)(void *head, void (*iterator)(void *key)));
+    void (*iterate)(void *head, void (*iterator)(void *key)),
+    void *(*peek)(queue_t queue, queue_handle_t *handle),
+    int (*remove_handle)(queue_t queue, queue_handle_t handle));
 
 /* Frees the memory occupied by this queue. */
 void queue_delete(queue_t queue);
@@ -63,6 +93,24 @@ void queue_delete(queue_t queue);
 /* Pushes a key in the queue, returns 0 for success and -1 for failure */
 int queue_push(queue_t queue, void *key);
 
+/* Pushes a key with the given priority, lower values first; queues that are
+ * not PRIORITY ignore the priority. Returns 0 for success. */
+int queue_push_priority(queue_t queue, void *key, long priority);
+
+/* Pushes count keys in the queue, as a single operation when the queue
+ * supports it; returns 0 for success */
+int queue_push_batch(queue_t queue, void **keys, unsigned int count);
+
+/* Moves up to count keys from src to dst and calls the iterator, if not NULL,
+ * for every moved key; returns the number of moved keys. Queues with the same
+ * policy relink or copy a whole run of keys at once: the oldest keys of a
+ * ROUND_ROBIN or MPSC_FIFO queue, the newest ones of a RANDOM queue and the
+ * leaves of a PRIORITY heap, whatever their priorities; keys of equal priority
+ * moved to a PRIORITY queue come after its own, not in their push order. The
+ * caller must be src's only consumer. */
+unsigned int queue_splice(queue_t src, queue_t dst, unsigned int count,
+    void (*iterator)(void *key));
+
 /* Removes a key from the queue, returns 0 for success and -1 for failure */
 int queue_remove_key(queue_t queue, void *key,
     int (*compare)(void *key1, void *key2));
@@ -70,6 +118,20 @@ int queue_remove_key(queue_t queue, void *key,
 /* Returns an element in the queue, according to the queue's balancing policy */
 void *queue_get_key(queue_t queue);
 
+/* Returns the next element to be removed, according to the queue's balancing
+ * policy, without removing it; if handle is not NULL, it is filled with the
+ * element's handle */
+void *queue_peek(queue_t queue, queue_handle_t *handle);
+
+/* Removes the element identified by handle in O(1), or O(log n) for a PRIORITY
+ * queue; returns 0 for success */
+int queue_remove_handle(queue_t queue, queue_handle_t handle);
+
+/* Removes and returns an element in O(1), or O(log n) for a PRIORITY queue,
+ * according to the queue's balancing policy; returns NULL if the queue is
+ * empty */
+void *queue_pop(queue_t queue);
+
 /* Iterates over a queue and calls the iterator for every key in the queue */
 void queue_iterate(queue_t queue, void (*iterator)(void *key));
 
@@ -82,4 +144,7 @@ float execute_task(void (*)(void));
 /* Returns the number of elements in the queue */
 unsigned int queue_get_size(queue_t queue);
 
+/* Returns the queue's balancing policy */
+balancing_policy_t queue_get_balancing_policy(queue_t queue);
+
 #endif
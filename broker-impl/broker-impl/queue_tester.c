@@ -22,16 +22,25 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include "queue.h"
+#include "result_cache.h"
+#include "worker_table.h"
+#include "worker_index.h"
 
+#ifdef DEBUG
 static
 void iterator(void *key) {
-    printf("%d\n", (int) key);
+    printf("%d\n", (int) (long) key);
 }
 
 static
 int int_compare(void *key1, void *key2) {
-    return (int) key1 - (int) key2;
+    return (int) (long) key1 - (int) (long) key2;
 }
 
 static
@@ -82,6 +91,178 @@ void test_features(balancing_policy_t balancing_policy) {
     queue_delete(q);
 }
 
+static
+void test_pop(balancing_policy_t balancing_policy) {
+    queue_t q = queue_new(balancing_policy);
+    queue_handle_t handle;
+    long i, previous = 0, popped = 0;
+    
+    assert(queue_pop(q) == NULL);
+    
+    for (i = 1; i <= 5; i++) {
+        queue_push(q, (void *) i);
+    }
+    
+    // RANDOM queues give any key, the others the oldest one
+    long peeked = (long) queue_peek(q, &handle);
+    assert(peeked >= 1 && peeked <= 5);
+    assert(balancing_policy == RANDOM || peeked == 1);
+    assert(queue_remove_handle(q, handle) == SUCCESS);
+    assert(queue_get_size(q) == 4);
+    
+    while (queue_get_size(q) > 0) {
+        long key = (long) queue_pop(q);
+        assert(key >= 1 && key <= 5 && key != peeked);
+        assert(!(popped & (1L << key)));
+        assert(balancing_policy == RANDOM || key > previous);
+        popped |= 1L << key;
+        previous = key;
+    }
+    assert(popped == (0x3e & ~(1L << peeked)));
+    
+    assert(queue_pop(q) == NULL);
+    queue_delete(q);
+}
+
+static
+void test_priority(void) {
+    queue_t q = queue_new(PRIORITY);
+    long priorities[] = { 5, 1, 3, 1, 7, 0, 3, 9 };
+    long i;
+    
+    queue_push(q, (void *) 0x100);
+    for (i = 0; i < (long) (sizeof(priorities) / sizeof(priorities[0])); i++) {
+        queue_push_priority(q, (void *) (i + 1), priorities[i]);
+    }
+    
+    // Lower priorities first, equal ones in push order, then the default one
+    long expected[] = { 6, 2, 4, 3, 7, 1, 5, 8, 0x100 };
+    for (i = 0; i < 9; i++) {
+        assert((long) queue_pop(q) == expected[i]);
+    }
+    assert(queue_get_size(q) == 0);
+    
+    queue_delete(q);
+}
+
+static long spliced_keys;
+
+static
+void count_spliced(void *key) {
+    spliced_keys += key != NULL;
+}
+
+static
+void test_splice(balancing_policy_t balancing_policy, unsigned int slab_nodes) {
+    queue_t src = queue_new_with_slab(balancing_policy, slab_nodes);
+    queue_t dst = queue_new_with_slab(balancing_policy, slab_nodes);
+    void *keys[] = { (void *) 0x100, (void *) 0x101 };
+    long i;
+    
+    for (i = 1; i <= 10; i++) {
+        queue_push(src, (void *) i);
+    }
+    queue_push_batch(dst, keys, 2);
+    
+    spliced_keys = 0;
+    assert(queue_splice(src, dst, 4, count_spliced) == 4);
+    assert(spliced_keys == 4);
+    assert(queue_get_size(src) == 6 && queue_get_size(dst) == 6);
+    
+    // More than the source holds
+    assert(queue_splice(src, dst, 100, NULL) == 6);
+    assert(queue_get_size(src) == 0 && queue_get_size(dst) == 12);
+    assert(queue_pop(src) == NULL);
+    
+    long sum = 0;
+    while (queue_get_size(dst) > 0) {
+        sum += (long) queue_pop(dst);
+    }
+    assert(sum == 55 + 0x100 + 0x101);
+    
+    queue_delete(src);
+    queue_delete(dst);
+}
+
+/* Grows the queue well past its initial capacity, then drains it through
+ * every removal path, so that the ring wraps around and shrinks back */
+static
+void test_burst(balancing_policy_t balancing_policy) {
+    queue_t q = queue_new(balancing_policy);
+    long i, removed = 0;
+    
+    for (i = 1; i <= 10000; i++) {
+        queue_push(q, (void *) i);
+    }
+    
+    for (i = 1; i <= 2500; i++) {
+        removed += queue_remove_key(q, (void *) i, int_compare) == SUCCESS;
+    }
+    
+    for (i = 10001; i <= 12000; i++) {
+        queue_push(q, (void *) i);
+        removed += queue_pop(q) != NULL;
+    }
+    
+    while (queue_pop(q)) {
+        removed++;
+    }
+    
+    assert(removed == 12000);
+    assert(queue_get_size(q) == 0);
+    queue_delete(q);
+}
+
+#define SPSC_TEST_KEYS 1000000
+
+static
+void *spsc_producer(void *input) {
+    queue_t q = (queue_t) input;
+    void *batch[7];
+    long i = 1, j;
+    
+    // Mix single pushes with batches that straddle the chunks' ends
+    while (i <= SPSC_TEST_KEYS) {
+        if (i % 3) {
+            queue_push(q, (void *) i++);
+            continue;
+        }
+        for (j = 0; j < 7 && i <= SPSC_TEST_KEYS; j++) {
+            batch[j] = (void *) i++;
+        }
+        queue_push_batch(q, batch, j);
+    }
+    
+    return NULL;
+}
+
+/* One producer thread and one consumer thread; the consumer has to see every
+ * key, in order */
+static
+void test_spsc_threads(void) {
+    queue_t q = queue_new(SPSC_RING);
+    pthread_t producer;
+    long expected = 1, out_of_order = 0;
+    
+    pthread_create(&producer, NULL, spsc_producer, q);
+    
+    while (expected <= SPSC_TEST_KEYS) {
+        void *key = queue_pop(q);
+        if (!key) {
+            continue;
+        }
+        out_of_order += (long) key != expected;
+        expected++;
+    }
+    
+    pthread_join(producer, NULL);
+    
+    assert(out_of_order == 0);
+    assert(queue_get_size(q) == 0);
+    queue_delete(q);
+}
+
+#else
 static
 void stress_test(balancing_policy_t balancing_policy) {
     queue_t q = queue_new(balancing_policy);
@@ -102,6 +283,654 @@ void stress_test_random() {
     stress_test(RANDOM);
 }
 
+#define BENCHMARK_OPERATIONS (1 << 22)
+
+static queue_t benchmark_queue;
+
+static
+void benchmark_push(void) {
+    long i;
+    for (i = 1; i <= BENCHMARK_OPERATIONS; i++) {
+        queue_push_priority(benchmark_queue, (void *) i, (i * 7919) % 1024);
+    }
+}
+
+static
+void benchmark_pop(void) {
+    while (queue_pop(benchmark_queue));
+}
+
+/* Reports the cost of push and pop operations, in nanoseconds per operation;
+ * the second push runs on the nodes released by the first pop */
+static
+void benchmark(const char *label, balancing_policy_t balancing_policy,
+    unsigned int slab_nodes) {
+    benchmark_queue = queue_new_with_slab(balancing_policy, slab_nodes);
+    
+    float push = execute_task(benchmark_push);
+    float pop = execute_task(benchmark_pop);
+    float push_recycled = execute_task(benchmark_push);
+    
+    printf("%s push %.1f ns/op, pop %.1f ns/op, push (recycled) %.1f ns/op\n",
+        label,
+        push * 1e9 / BENCHMARK_OPERATIONS,
+        pop * 1e9 / BENCHMARK_OPERATIONS,
+        push_recycled * 1e9 / BENCHMARK_OPERATIONS);
+    
+    queue_delete(benchmark_queue);
+}
+
+static
+double wall_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+#define SPLICE_BACKLOG 50000
+
+/* Moves half of a backlog to another queue, first one key at a time and then
+ * with queue_splice; the label names the path queue_splice takes */
+static
+void splice_benchmark(const char *label, balancing_policy_t balancing_policy,
+    unsigned int slab_nodes) {
+    queue_t src = queue_new_with_slab(balancing_policy, slab_nodes);
+    queue_t dst = queue_new_with_slab(balancing_policy, slab_nodes);
+    long i;
+    
+    for (i = 1; i <= SPLICE_BACKLOG; i++) {
+        queue_push(src, (void *) i);
+    }
+    
+    double start = wall_clock();
+    for (i = 0; i < SPLICE_BACKLOG / 2; i++) {
+        queue_push(dst, queue_pop(src));
+    }
+    double one_by_one = wall_clock() - start;
+    
+    start = wall_clock();
+    queue_splice(dst, src, SPLICE_BACKLOG / 2, NULL);
+    double spliced = wall_clock() - start;
+    
+    printf("%s relocate %d keys: one by one %.1f us, splice %.1f us\n",
+        label, SPLICE_BACKLOG / 2, one_by_one * 1e6, spliced * 1e6);
+    
+    queue_delete(src);
+    queue_delete(dst);
+}
+
+#define CONTENTION_PRODUCERS  4
+#define CONTENTION_OPERATIONS (1 << 20)
+
+typedef struct {
+    queue_t queue;
+    pthread_mutex_t *mutex;
+    long first_key;
+} contention_producer_t;
+
+static
+void *contention_producer(void *input) {
+    contention_producer_t *producer = (contention_producer_t *) input;
+    long i;
+    for (i = 0; i < CONTENTION_OPERATIONS; i++) {
+        if (producer->mutex) {
+            pthread_mutex_lock(producer->mutex);
+        }
+        queue_push(producer->queue, (void *) (producer->first_key + i));
+        if (producer->mutex) {
+            pthread_mutex_unlock(producer->mutex);
+        }
+    }
+    return NULL;
+}
+
+/* Several producers push while the main thread pops everything; without a
+ * mutex the queue has to be safe for concurrent pushes on its own */
+static
+void contention_benchmark(const char *label, balancing_policy_t balancing_policy,
+    int use_mutex) {
+    queue_t q = queue_new(balancing_policy);
+    pthread_mutex_t mutex;
+    pthread_t threads[CONTENTION_PRODUCERS];
+    contention_producer_t producers[CONTENTION_PRODUCERS];
+    long expected = (long) CONTENTION_PRODUCERS * CONTENTION_OPERATIONS;
+    long popped = 0, empty_polls = 0;
+    int i;
+    
+    pthread_mutex_init(&mutex, NULL);
+    
+    double start = wall_clock();
+    for (i = 0; i < CONTENTION_PRODUCERS; i++) {
+        producers[i].queue = q;
+        producers[i].mutex = use_mutex ? &mutex : NULL;
+        producers[i].first_key = 1 + (long) i * CONTENTION_OPERATIONS;
+        pthread_create(&threads[i], NULL, contention_producer, &producers[i]);
+    }
+    
+    while (popped < expected) {
+        if (use_mutex) {
+            pthread_mutex_lock(&mutex);
+        }
+        void *key = queue_pop(q);
+        if (use_mutex) {
+            pthread_mutex_unlock(&mutex);
+        }
+        if (key) {
+            popped++;
+        } else {
+            empty_polls++;
+        }
+    }
+    
+    for (i = 0; i < CONTENTION_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = wall_clock() - start;
+    
+    printf("%s %d producers, %.1f ns/op, %ld empty polls\n",
+        label, CONTENTION_PRODUCERS, seconds * 1e9 / expected, empty_polls);
+    
+    pthread_mutex_destroy(&mutex);
+    queue_delete(q);
+}
+#endif
+
+/* Creates a table of count workers with random loads, some of them IDLE and
+ * some of them overloaded */
+static
+worker_table_t *new_loaded_table(int count) {
+    worker_table_t *table = (worker_table_t *) malloc(sizeof(worker_table_t));
+    int i;
+    
+    worker_table_init(table);
+    worker_table_reserve(table, count);
+    
+    for (i = 0; i < count; i++) {
+        worker_state_t state = (worker_state_t) calloc(1, sizeof(struct __worker_state_t));
+        init_default_runtime_settings(&state->runtime);
+        state->runtime.cpu_load = (double) rand() / RAND_MAX;
+        state->runtime.memory_load = (double) rand() / RAND_MAX;
+        state->runtime.network_load = i % 3 ? (double) rand() / RAND_MAX : 0.95;
+        worker_table_set(table, i, state);
+    }
+    table->count = count;
+    
+    return table;
+}
+
+static
+void free_loaded_table(worker_table_t *table) {
+    int i;
+    for (i = 0; i < table->count; i++) {
+        free(table->states[i]);
+    }
+    worker_table_destroy(table);
+    free(table);
+}
+
+#ifdef DEBUG
+/* Checks the vectorized classification against get_runtime_load, for sizes
+ * that leave every possible tail */
+static
+void test_classify_loads(void) {
+    int count;
+    
+    for (count = 0; count <= 67; count++) {
+        worker_table_t *table = new_loaded_table(count);
+        double snapshot[count + 1];
+        int idle[count + 1], overload[count + 1];
+        worker_load_classes_t classes = { idle, 0, overload, 0, 0 };
+        int i, idle_count = 0, overload_count = 0, host_count = 0;
+        
+        worker_table_classify_loads(table, snapshot, &classes);
+        
+        for (i = 0; i < count; i++) {
+            double load = get_runtime_load(&table->states[i]->runtime);
+            assert(snapshot[i] == load);
+            
+            if (load <= WORKER_IDLE_LOAD_THRESHOLD) {
+                assert(classes.idle[idle_count] == i);
+                idle_count++;
+            } else if (load <= WORKER_ACCEPT_LOAD_THRESHOLD) {
+                host_count++;
+            } else if (load >= WORKER_OVER_LOAD_THRESHOLD) {
+                assert(classes.overload[overload_count] == i);
+                overload_count++;
+            }
+        }
+        
+        assert(classes.idle_count == idle_count);
+        assert(classes.overload_count == overload_count);
+        assert(classes.host_count == host_count);
+        
+        free_loaded_table(table);
+    }
+    
+    printf("classify loads ok\n");
+}
+
+/* Checks that the same tasks weigh less on a larger machine, also when the
+ * machine advertises its resources after it got tasks */
+static
+void test_worker_capacity(void) {
+    worker_statistics_t small, large;
+    int i;
+    
+    init_default_runtime_settings(&small);
+    init_default_runtime_settings(&large);
+    set_worker_capacity(&small, 2 * RESOURCE_CPU_PER_CORE, 2048, 125);
+    
+    for (i = 0; i < 4; i++) {
+        update_worker_runtime(&small, "echo", 1);
+        update_worker_runtime(&large, "echo", 1);
+    }
+    set_worker_capacity(&large, 16 * RESOURCE_CPU_PER_CORE, 65536, 1250);
+    
+    double cpu_ratio = small.cpu_load / large.cpu_load;
+    assert(cpu_ratio > 8 - 1e-9 && cpu_ratio < 8 + 1e-9);
+    assert(get_runtime_effort(&large, AVAILABLE) <
+        get_runtime_effort(&small, AVAILABLE));
+    
+    // The memory and the network of the tasks of unknown cost are a share of
+    // the worker's own, whatever its size; a worker that advertised no
+    // bandwidth gets no network load
+    double share = 4 * DEFAULT_TASK_SHARE;
+    assert(small.memory_load > share - 1e-9 && small.memory_load < share + 1e-9);
+    assert(small.network_load > share - 1e-9 && small.network_load < share + 1e-9);
+    assert(large.network_load == 0.0);
+    
+    // Resources that are not advertised keep their value
+    set_worker_capacity(&large, 0, 0, 0);
+    assert(large.cpu == 16 * RESOURCE_CPU_PER_CORE);
+    
+    printf("worker capacity ok\n");
+}
+
+/* Checks that the heartbeats pull the estimated loads toward the measured
+ * ones, with the run queue counting when the CPUs are saturated */
+static
+void test_measured_load(void) {
+    worker_statistics_t runtime;
+    
+    init_default_runtime_settings(&runtime);
+    blend_measured_load(&runtime, 0.8, 0.4, 0);
+    assert(runtime.cpu_load > 0.0 && runtime.cpu_load < 0.8);
+    assert(runtime.memory_load > 0.0 && runtime.memory_load < 0.4);
+    
+    // A task that was estimated higher than measured leaves no negative load
+    init_default_runtime_settings(&runtime);
+    record_command_cost(get_command_key("stress"), 1000000, 4000000, 0);
+    update_worker_runtime(&runtime, "stress", 1);
+    blend_measured_load(&runtime, 0.2, 0.0, 0);
+    update_worker_runtime(&runtime, "stress", -1);
+    assert(runtime.cpu_load == 0.0 && runtime.memory_load == 0.0);
+    
+    // Eight runnable processes on the default four CPUs
+    init_default_runtime_settings(&runtime);
+    blend_measured_load(&runtime, 1.0, 0.0, 8);
+    assert(runtime.cpu_load > 0.5 && runtime.run_queue == 8);
+    
+    printf("measured load ok\n");
+}
+
+/* Checks that the commands are told apart by their normalized text and that
+ * their tasks are charged what they were measured to cost */
+static
+void test_command_costs(void) {
+    assert(get_command_key("sleep 1") == get_command_key("sleep  20"));
+    assert(get_command_key("sleep 1") != get_command_key("sleepy 1"));
+    
+    long cpu, memory, network;
+    estimate_request("compress 1", &cpu, &memory, &network);
+    assert(cpu == 0.2 * DEFAULT_RESOURCE_CPU);
+    
+    // Half a CPU busy and 512 MB resident
+    record_command_cost(get_command_key("compress 1"), 2000000, 1000000,
+        512 * 1024);
+    worker_task_t task = new_task(NULL, "compress 2");
+    assert(task->command == get_command_key("compress 1"));
+    assert(task->cpu == RESOURCE_CPU_PER_CORE / 2 && task->memory == 512);
+    
+    worker_statistics_t runtime;
+    init_default_runtime_settings(&runtime);
+    charge_worker_task(&runtime, task, 1);
+    assert(runtime.cpu_load > 0.0);
+    charge_worker_task(&runtime, task, -1);
+    assert(runtime.cpu_load == 0.0 && runtime.memory_load == 0.0);
+    free(task);
+    
+    // Commands are large once they were measured to run for long
+    assert(get_task_size_class("render 1") == 0);
+    record_command_cost(get_command_key("render 1"), 5000000, 5000000, 0);
+    assert(get_task_size_class("render 2") == 1);
+    record_command_cost(get_command_key("true"), 1000, 500, 0);
+    assert(get_task_size_class("true") == 0);
+    
+    printf("command costs ok\n");
+}
+
+/* Checks that the identical requests are dispatched once while their output
+ * is fresh, and that the cache stays within its size */
+static
+void test_result_cache(void) {
+    result_cache_t cache = result_cache_new(4096, 1000);
+    result_cache_statistics_t statistics;
+    const void *output;
+    size_t output_size;
+    int joined_count;
+    
+    assert(result_cache_lookup(cache, "c1", "uname -a", 8, 0, &output,
+        &output_size) == RESULT_CACHE_MISS);
+    assert(result_cache_lookup(cache, "c2", "uname -a", 8, 10, &output,
+        &output_size) == RESULT_CACHE_JOINED);
+    char **joined = result_cache_complete(cache, "c1", "Linux", 5, 1, 20,
+        &joined_count);
+    assert(joined_count == 1 && !strcmp(joined[0], "c2"));
+    free(joined[0]);
+    free(joined);
+    
+    assert(result_cache_lookup(cache, "c3", "uname -a", 8, 500, &output,
+        &output_size) == RESULT_CACHE_HIT);
+    assert(output_size == 5 && !memcmp(output, "Linux", 5));
+    
+    // Expired, then not cacheable
+    assert(result_cache_lookup(cache, "c4", "uname -a", 8, 1020, &output,
+        &output_size) == RESULT_CACHE_MISS);
+    result_cache_complete(cache, "c4", "error", 5, 0, 1030, &joined_count);
+    assert(result_cache_lookup(cache, "c5", "uname -a", 8, 1040, &output,
+        &output_size) == RESULT_CACHE_MISS);
+    
+    // Given up on after the TTL, e.g. lost along with its server
+    assert(result_cache_lookup(cache, "c7", "uname -a", 8, 1050, &output,
+        &output_size) == RESULT_CACHE_JOINED);
+    assert(!result_cache_expire(cache, 2000, &joined_count) && !joined_count);
+    joined = result_cache_expire(cache, 2040, &joined_count);
+    assert(joined_count == 1 && !strcmp(joined[0], "c7"));
+    free(joined[0]);
+    free(joined);
+    assert(!result_cache_complete(cache, "c5", "Linux", 5, 1, 2050,
+        &joined_count) && !joined_count);
+    
+    // Only the most recently used outputs fit
+    char request[16];
+    int it;
+    for (it = 0; it < 100; it++) {
+        snprintf(request, sizeof(request), "echo %d", it);
+        result_cache_lookup(cache, request, request, strlen(request), 2000,
+            &output, &output_size);
+        result_cache_complete(cache, request, "0123456789", 10, 1, 2000,
+            &joined_count);
+    }
+    result_cache_get_statistics(cache, &statistics);
+    assert(statistics.size <= 4096 && statistics.evictions > 0);
+    assert(statistics.hits == 1 && statistics.joined == 2);
+    assert(statistics.abandoned == 1);
+    assert(result_cache_lookup(cache, "c6", "echo 99", 7, 2500, &output,
+        &output_size) == RESULT_CACHE_HIT);
+    
+    result_cache_delete(cache);
+    
+    printf("result cache ok\n");
+}
+
+#else
+#define CLASSIFY_WORKER_VISITS 50000000
+
+/* Compares the rebalancer's classification through the workers' states, as
+ * it was done before the hot fields got their own arrays, with the single
+ * pass over the workers table */
+static
+void classify_benchmark(int count) {
+    worker_table_t *table = new_loaded_table(count);
+    double *snapshot = (double *) malloc(count * sizeof(double));
+    int *idle = (int *) malloc(count * sizeof(int));
+    int *overload = (int *) malloc(count * sizeof(int));
+    int rounds = CLASSIFY_WORKER_VISITS / count;
+    int round, i;
+    long candidates = 0;
+    
+    double start = wall_clock();
+    for (round = 0; round < rounds; round++) {
+        int idle_count = 0, overload_count = 0, host_count = 0;
+        
+        for (i = 0; i < count; i++) {
+            snapshot[i] = get_runtime_load(&table->states[i]->runtime);
+        }
+        for (i = 0; i < count; i++) {
+            if (snapshot[i] <= WORKER_IDLE_LOAD_THRESHOLD) {
+                idle_count++;
+            } else if (snapshot[i] <= WORKER_ACCEPT_LOAD_THRESHOLD) {
+                host_count++;
+            } else if (snapshot[i] >= WORKER_OVER_LOAD_THRESHOLD) {
+                overload_count++;
+            }
+        }
+        if (overload_count > 0 && (host_count > 0 || idle_count > 0)) {
+            idle_count = overload_count = 0;
+            for (i = 0; i < count; i++) {
+                if (snapshot[i] <= WORKER_IDLE_LOAD_THRESHOLD) {
+                    idle[idle_count++] = i;
+                } else if (snapshot[i] >= WORKER_OVER_LOAD_THRESHOLD) {
+                    overload[overload_count++] = i;
+                }
+            }
+        }
+        candidates += idle_count + overload_count;
+    }
+    double scalar = wall_clock() - start;
+    
+    worker_load_classes_t classes = { idle, 0, overload, 0, 0 };
+    start = wall_clock();
+    for (round = 0; round < rounds; round++) {
+        worker_table_classify_loads(table, snapshot, &classes);
+        candidates -= classes.idle_count + classes.overload_count;
+    }
+    double vector = wall_clock() - start;
+    
+    printf("classify %d workers: states %.2lf ns/worker, table %.2lf ns/worker%s\n",
+        count,
+        scalar * 1e9 / ((double) rounds * count),
+        vector * 1e9 / ((double) rounds * count),
+        candidates ? " (MISMATCH)" : "");
+    
+    free(snapshot);
+    free(idle);
+    free(overload);
+    free_loaded_table(table);
+}
+
+#define MAPPING_WORKERS           1000
+#define MAPPING_ROUNDS            500
+#define MAPPING_ARRIVALS          9
+#define MAPPING_SERVICES          10
+
+typedef enum {
+    MAPPING_SCAN,
+    MAPPING_INDEX,
+    MAPPING_CHOICES
+} mapping_benchmark_t;
+
+/* Places tasks on MAPPING_WORKERS workers, while randomly picked workers
+ * complete them, at 90% utilization; the workers' effort only follows their
+ * queue lengths. Reports the cost of a placement, including the bookkeeping,
+ * and the longest and the average queue at the end. */
+static
+void mapping_benchmark(const char *label, mapping_benchmark_t strategy,
+    int choices) {
+    worker_table_t *table = new_loaded_table(MAPPING_WORKERS);
+    worker_index_t index = worker_index_new();
+    uint32_t seed = 12345;
+    long placed = 0;
+    int round, i;
+    
+    for (i = 0; i < MAPPING_WORKERS; i++) {
+        worker_state_t state = table->states[i];
+        state->status = AVAILABLE;
+        state->tasks = queue_new(RANDOM);
+        init_default_runtime_settings(&state->runtime);
+        worker_table_refresh(table, i);
+        worker_index_update(index, i, state);
+    }
+    
+    srand(1);
+    double start = wall_clock();
+    for (round = 0; round < MAPPING_ROUNDS * MAPPING_WORKERS / MAPPING_ARRIVALS; round++) {
+        for (i = 0; i < MAPPING_ARRIVALS; i++) {
+            int worker_id = INVALID_WORKER_ID, it;
+            
+            if (strategy == MAPPING_SCAN) {
+                double best_effort = 0;
+                for (it = 0; it < table->count; it++) {
+                    double effort = get_runtime_effort(&table->states[it]->runtime,
+                        table->states[it]->status);
+                    if (worker_id == INVALID_WORKER_ID || effort < best_effort) {
+                        best_effort = effort;
+                        worker_id = it;
+                    }
+                }
+            } else if (strategy == MAPPING_INDEX) {
+                worker_id = worker_index_least_effort(index);
+            } else {
+                worker_id = worker_table_least_effort_of(table, choices, &seed);
+            }
+            
+            table->states[worker_id]->runtime.assigned_tasks++;
+            worker_table_refresh(table, worker_id);
+            worker_index_update(index, worker_id, table->states[worker_id]);
+            placed++;
+        }
+        
+        for (i = 0; i < MAPPING_SERVICES; i++) {
+            int worker_id = rand() % MAPPING_WORKERS;
+            if (table->states[worker_id]->runtime.assigned_tasks > 0) {
+                table->states[worker_id]->runtime.assigned_tasks--;
+                worker_table_refresh(table, worker_id);
+                worker_index_update(index, worker_id, table->states[worker_id]);
+            }
+        }
+    }
+    double seconds = wall_clock() - start;
+    
+    int longest = 0;
+    long queued = 0;
+    for (i = 0; i < MAPPING_WORKERS; i++) {
+        int length = table->states[i]->runtime.assigned_tasks;
+        queued += length;
+        if (length > longest) {
+            longest = length;
+        }
+        queue_delete(table->states[i]->tasks);
+    }
+    
+    printf("%s: %.1lf ns/task, longest queue %d, average queue %.2lf\n",
+        label, seconds * 1e9 / placed, longest, (double) queued / MAPPING_WORKERS);
+    
+    worker_index_delete(index);
+    free_loaded_table(table);
+}
+
+#define SHARD_WORKERS             1024
+#define SHARD_TASKS               (1 << 21)
+
+typedef struct {
+    pthread_mutex_t mutex;
+    worker_table_t *table;
+    worker_index_t index;
+    int tasks;
+} shard_benchmark_t;
+
+/* One shard's scheduler: maps every task to the worker with the least effort,
+ * dispatches it and completes it, with the broker's bookkeeping, under the
+ * shard's mutex */
+static
+void *shard_scheduler(void *input) {
+    shard_benchmark_t *shard = (shard_benchmark_t *) input;
+    struct __worker_task_t task = { NULL, "echo", NULL, QUEUE_DEFAULT_PRIORITY, 0,
+        0, 0, 0, 0 };
+    int i;
+    
+    for (i = 0; i < shard->tasks; i++) {
+        pthread_mutex_lock(&shard->mutex);
+        
+        int worker_id = worker_index_least_effort(shard->index);
+        worker_state_t state = shard->table->states[worker_id];
+        worker_push_task(state, &task);
+        update_worker_runtime(&state->runtime, task.request, 1);
+        worker_table_refresh(shard->table, worker_id);
+        worker_index_update(shard->index, worker_id, state);
+        
+        worker_id = worker_index_next_dispatchable(shard->index);
+        state = shard->table->states[worker_id];
+        worker_pop_task(state);
+        state->status = BUSY;
+        worker_table_refresh(shard->table, worker_id);
+        worker_index_update(shard->index, worker_id, state);
+        
+        state->status = AVAILABLE;
+        update_worker_runtime(&state->runtime, NULL, -1);
+        worker_table_refresh(shard->table, worker_id);
+        worker_index_update(shard->index, worker_id, state);
+        
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    
+    return NULL;
+}
+
+/* Schedules SHARD_TASKS tasks on SHARD_WORKERS workers split into shards,
+ * each with its own scheduler thread; the speedup over a single scheduler is
+ * bounded by the number of cores */
+static
+double shard_benchmark(int shards, double single_seconds) {
+    shard_benchmark_t *benchmark = (shard_benchmark_t *)
+        calloc(shards, sizeof(shard_benchmark_t));
+    pthread_t *threads = (pthread_t *) calloc(shards, sizeof(pthread_t));
+    int shard, i;
+    
+    for (shard = 0; shard < shards; shard++) {
+        benchmark[shard].table = new_loaded_table(SHARD_WORKERS / shards);
+        benchmark[shard].index = worker_index_new();
+        benchmark[shard].tasks = SHARD_TASKS / shards;
+        pthread_mutex_init(&benchmark[shard].mutex, NULL);
+        for (i = 0; i < benchmark[shard].table->count; i++) {
+            worker_state_t state = benchmark[shard].table->states[i];
+            state->status = AVAILABLE;
+            state->tasks = queue_new(MPSC_FIFO);
+            init_default_runtime_settings(&state->runtime);
+            worker_table_refresh(benchmark[shard].table, i);
+            worker_index_update(benchmark[shard].index, i, state);
+        }
+    }
+    
+    double start = wall_clock();
+    for (shard = 0; shard < shards; shard++) {
+        pthread_create(&threads[shard], NULL, shard_scheduler, &benchmark[shard]);
+    }
+    for (shard = 0; shard < shards; shard++) {
+        pthread_join(threads[shard], NULL);
+    }
+    double seconds = wall_clock() - start;
+    
+    printf("shards %d: %.1lf ns/task, %.2lfx the single scheduler\n",
+        shards, seconds * 1e9 / SHARD_TASKS,
+        single_seconds > 0 ? single_seconds / seconds : 1.0);
+    
+    for (shard = 0; shard < shards; shard++) {
+        for (i = 0; i < benchmark[shard].table->count; i++) {
+            queue_delete(benchmark[shard].table->states[i]->tasks);
+        }
+        worker_index_delete(benchmark[shard].index);
+        free_loaded_table(benchmark[shard].table);
+        pthread_mutex_destroy(&benchmark[shard].mutex);
+    }
+    free(threads);
+    free(benchmark);
+    
+    return seconds;
+}
+
+#endif
+
 static
 void debug() {
     queue_t q = queue_new(ROUND_ROBIN);
@@ -118,12 +947,74 @@ int main(void) {
 #ifdef DEBUG
     test_alloc(ROUND_ROBIN);
     test_features(ROUND_ROBIN);
+    test_pop(ROUND_ROBIN);
+    test_splice(ROUND_ROBIN, QUEUE_DEFAULT_SLAB_NODES);
+    test_splice(ROUND_ROBIN, 0);
     
     test_alloc(RANDOM);
     test_features(RANDOM);
+    test_pop(RANDOM);
+    test_burst(RANDOM);
+    test_splice(RANDOM, 0);
+    
+    test_alloc(MPSC_FIFO);
+    test_pop(MPSC_FIFO);
+    test_splice(MPSC_FIFO, 0);
+    
+    test_alloc(PRIORITY);
+    test_features(PRIORITY);
+    test_pop(PRIORITY);
+    test_burst(PRIORITY);
+    test_priority();
+    test_splice(PRIORITY, 0);
+    
+    test_alloc(SPSC_RING);
+    test_pop(SPSC_RING);
+    test_burst(SPSC_RING);
+    test_spsc_threads();
+    
+    test_classify_loads();
+    test_worker_capacity();
+    test_measured_load();
+    test_command_costs();
+    test_result_cache();
 #else
     printf("ROUND_ROBIN %f\n", execute_task(stress_test_round_robin));
     printf("RANDOM %f\n", execute_task(stress_test_random));
+    
+    benchmark("ROUND_ROBIN (malloc)", ROUND_ROBIN, 0);
+    benchmark("ROUND_ROBIN (slab)", ROUND_ROBIN, QUEUE_DEFAULT_SLAB_NODES);
+    benchmark("RANDOM", RANDOM, 0);
+    benchmark("MPSC_FIFO", MPSC_FIFO, 0);
+    benchmark("PRIORITY", PRIORITY, 0);
+    benchmark("SPSC_RING", SPSC_RING, 0);
+    
+    splice_benchmark("ROUND_ROBIN (slab nodes, keys copied into a run)",
+        ROUND_ROBIN, QUEUE_DEFAULT_SLAB_NODES);
+    splice_benchmark("ROUND_ROBIN (no slabs, nodes relinked)", ROUND_ROBIN, 0);
+    splice_benchmark("RANDOM (ring runs copied)", RANDOM, QUEUE_DEFAULT_SLAB_NODES);
+    splice_benchmark("MPSC_FIFO (keys shifted, run published)", MPSC_FIFO,
+        QUEUE_DEFAULT_SLAB_NODES);
+    splice_benchmark("PRIORITY (leaves cut and sifted)", PRIORITY,
+        QUEUE_DEFAULT_SLAB_NODES);
+    
+    contention_benchmark("ROUND_ROBIN (mutex)", ROUND_ROBIN, 1);
+    contention_benchmark("MPSC_FIFO (lock-free)", MPSC_FIFO, 0);
+    
+    classify_benchmark(1000);
+    classify_benchmark(10000);
+    classify_benchmark(100000);
+    
+    mapping_benchmark("least effort (scan)", MAPPING_SCAN, 0);
+    mapping_benchmark("least effort (index)", MAPPING_INDEX, 0);
+    mapping_benchmark("random", MAPPING_CHOICES, 1);
+    mapping_benchmark("power of 2 choices", MAPPING_CHOICES, 2);
+    mapping_benchmark("power of 3 choices", MAPPING_CHOICES, 3);
+    
+    double single_seconds = shard_benchmark(1, 0);
+    shard_benchmark(2, single_seconds);
+    shard_benchmark(4, single_seconds);
+    shard_benchmark(8, single_seconds);
 #endif
     
     debug();
@@ -0,0 +1,492 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Cache of the outputs of the clients' requests, keyed by the requests' bytes,
+ for the commands that give the same output every time they run.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "result_cache.h"
+
+#define RESULT_CACHE_MIN_CAPACITY      64
+
+/* An output takes at most this share of the cache, so that a single large
+ * output does not flush all the others */
+#define RESULT_CACHE_MAX_OUTPUT_SHARE  8
+
+/* A request is either running, with the clients waiting for its output, or
+ * its output is cached */
+typedef struct __result_cache_entry_t {
+    void *request;
+    size_t request_size;
+    uint32_t hash;
+    
+    /* NULL while the request runs */
+    void *output;
+    size_t output_size;
+    
+    /* When the request was dispatched, while it runs, then when its output
+     * expires; in microseconds */
+    int64_t time;
+    
+    /* While the request runs: the client it was dispatched for and the
+     * clients that joined it */
+    char *client_id;
+    uint32_t client_hash;
+    char **joined;
+    int joined_count;
+    int joined_capacity;
+    
+    /* Chains of the requests' and the running clients' buckets */
+    struct __result_cache_entry_t *next_by_request;
+    struct __result_cache_entry_t *next_by_client;
+    
+    /* Cached outputs, from the most recently used one, or running requests,
+     * from the most recently dispatched one */
+    struct __result_cache_entry_t *newer;
+    struct __result_cache_entry_t *older;
+} result_cache_entry_t;
+
+typedef struct __result_cache_t {
+    result_cache_entry_t **by_request;
+    result_cache_entry_t **by_client;
+    unsigned int capacity;     // Buckets, always a power of two
+    unsigned int count;        // Entries, running or cached
+    
+    result_cache_entry_t *newest;
+    result_cache_entry_t *oldest;
+    result_cache_entry_t *running_newest;
+    result_cache_entry_t *running_oldest;
+    
+    size_t max_size;
+    int64_t ttl_us;
+    
+    result_cache_statistics_t statistics;
+} *_result_cache_t;
+
+/* FNV-1a over the given bytes */
+static
+uint32_t result_cache_hash(const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    uint32_t hash = 2166136261u;
+    
+    while (size--) {
+        hash ^= *bytes++;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+/* Bytes taken by a cached output */
+static
+size_t result_cache_entry_size(result_cache_entry_t *entry) {
+    return sizeof(result_cache_entry_t) + entry->request_size + entry->output_size;
+}
+
+static
+result_cache_entry_t *result_cache_find_request(_result_cache_t cache,
+    const void *request, size_t request_size, uint32_t hash) {
+    result_cache_entry_t *entry = cache->by_request[hash & (cache->capacity - 1)];
+    
+    while (entry && (entry->hash != hash || entry->request_size != request_size ||
+        memcmp(entry->request, request, request_size))) {
+        entry = entry->next_by_request;
+    }
+    
+    return entry;
+}
+
+static
+result_cache_entry_t *result_cache_find_client(_result_cache_t cache,
+    const char *client_id, uint32_t client_hash) {
+    result_cache_entry_t *entry = cache->by_client[client_hash & (cache->capacity - 1)];
+    
+    while (entry && (entry->client_hash != client_hash ||
+        strcmp(entry->client_id, client_id))) {
+        entry = entry->next_by_client;
+    }
+    
+    return entry;
+}
+
+static
+void result_cache_link_client(_result_cache_t cache, result_cache_entry_t *entry) {
+    result_cache_entry_t **bucket =
+        &cache->by_client[entry->client_hash & (cache->capacity - 1)];
+    entry->next_by_client = *bucket;
+    *bucket = entry;
+}
+
+static
+void result_cache_unlink_client(_result_cache_t cache, result_cache_entry_t *entry) {
+    result_cache_entry_t **link =
+        &cache->by_client[entry->client_hash & (cache->capacity - 1)];
+    
+    while (*link != entry) {
+        link = &(*link)->next_by_client;
+    }
+    *link = entry->next_by_client;
+}
+
+/* Links an entry as the newest one of the list from newest to oldest */
+static
+void result_cache_link_newest(result_cache_entry_t **newest,
+    result_cache_entry_t **oldest, result_cache_entry_t *entry) {
+    entry->newer = NULL;
+    entry->older = *newest;
+    if (*newest) {
+        (*newest)->newer = entry;
+    } else {
+        *oldest = entry;
+    }
+    *newest = entry;
+}
+
+static
+void result_cache_unlink(result_cache_entry_t **newest,
+    result_cache_entry_t **oldest, result_cache_entry_t *entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        *newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        *oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+/* Makes an output the most recently used one */
+static
+void result_cache_touch(_result_cache_t cache, result_cache_entry_t *entry) {
+    if (cache->newest == entry) {
+        return;
+    }
+    
+    // Unlink it, if it is already in the list
+    if (entry->newer) {
+        result_cache_unlink(&cache->newest, &cache->oldest, entry);
+    }
+    result_cache_link_newest(&cache->newest, &cache->oldest, entry);
+}
+
+/* Removes an entry, running or cached, and frees it */
+static
+void result_cache_remove(_result_cache_t cache, result_cache_entry_t *entry) {
+    result_cache_entry_t **link =
+        &cache->by_request[entry->hash & (cache->capacity - 1)];
+    while (*link != entry) {
+        link = &(*link)->next_by_request;
+    }
+    *link = entry->next_by_request;
+    
+    if (entry->client_id) {
+        result_cache_unlink_client(cache, entry);
+    }
+    
+    if (entry->output) {
+        result_cache_unlink(&cache->newest, &cache->oldest, entry);
+        cache->statistics.entries--;
+        cache->statistics.size -= result_cache_entry_size(entry);
+    } else {
+        result_cache_unlink(&cache->running_newest, &cache->running_oldest, entry);
+    }
+    
+    int it;
+    for (it = 0; it < entry->joined_count; it++) {
+        free(entry->joined[it]);
+    }
+    free(entry->joined);
+    free(entry->client_id);
+    free(entry->request);
+    free(entry->output);
+    free(entry);
+    
+    cache->count--;
+}
+
+static
+int result_cache_rehash(_result_cache_t cache, unsigned int capacity) {
+    result_cache_entry_t **by_request = (result_cache_entry_t **)
+        calloc(capacity, sizeof(result_cache_entry_t *));
+    result_cache_entry_t **by_client = (result_cache_entry_t **)
+        calloc(capacity, sizeof(result_cache_entry_t *));
+    if (!by_request || !by_client) {
+        free(by_request);
+        free(by_client);
+        return -1;
+    }
+    
+    result_cache_entry_t **old_by_request = cache->by_request;
+    unsigned int old_capacity = cache->capacity;
+    
+    free(cache->by_client);
+    cache->by_request = by_request;
+    cache->by_client = by_client;
+    cache->capacity = capacity;
+    
+    unsigned int it;
+    for (it = 0; it < old_capacity; it++) {
+        result_cache_entry_t *entry = old_by_request[it];
+        while (entry) {
+            result_cache_entry_t *next = entry->next_by_request;
+            
+            result_cache_entry_t **bucket = &by_request[entry->hash & (capacity - 1)];
+            entry->next_by_request = *bucket;
+            *bucket = entry;
+            if (entry->client_id) {
+                result_cache_link_client(cache, entry);
+            }
+            
+            entry = next;
+        }
+    }
+    
+    free(old_by_request);
+    return 0;
+}
+
+result_cache_t result_cache_new(size_t max_size, int64_t ttl_us) {
+    _result_cache_t cache = (_result_cache_t) calloc(1, sizeof(struct __result_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    
+    if (result_cache_rehash(cache, RESULT_CACHE_MIN_CAPACITY)) {
+        free(cache);
+        return NULL;
+    }
+    
+    cache->max_size = max_size;
+    cache->ttl_us = ttl_us;
+    
+    return cache;
+}
+
+void result_cache_delete(result_cache_t result_cache) {
+    _result_cache_t cache = (_result_cache_t) result_cache;
+    if (!cache) {
+        return;
+    }
+    
+    unsigned int it;
+    for (it = 0; it < cache->capacity; it++) {
+        while (cache->by_request[it]) {
+            result_cache_remove(cache, cache->by_request[it]);
+        }
+    }
+    
+    free(cache->by_request);
+    free(cache->by_client);
+    free(cache);
+}
+
+result_cache_status_t result_cache_lookup(result_cache_t result_cache,
+    const char *client_id, const void *request, size_t request_size,
+    int64_t now, const void **output, size_t *output_size) {
+    _result_cache_t cache = (_result_cache_t) result_cache;
+    uint32_t hash = result_cache_hash(request, request_size);
+    result_cache_entry_t *entry = result_cache_find_request(cache, request,
+        request_size, hash);
+    
+    if (entry && entry->output) {
+        if (now < entry->time) {
+            result_cache_touch(cache, entry);
+            cache->statistics.hits++;
+            *output = entry->output;
+            *output_size = entry->output_size;
+            return RESULT_CACHE_HIT;
+        }
+        
+        cache->statistics.expirations++;
+        result_cache_remove(cache, entry);
+        entry = NULL;
+    }
+    
+    // Without memory, the request is dispatched as if there were no cache
+    char *copy = strdup(client_id);
+    if (!copy) {
+        cache->statistics.misses++;
+        return RESULT_CACHE_MISS;
+    }
+    
+    if (entry) {
+        if (now - entry->time < cache->ttl_us) {
+            if (entry->joined_count == entry->joined_capacity) {
+                int capacity = entry->joined_capacity ? 2 * entry->joined_capacity : 4;
+                char **joined = (char **) realloc(entry->joined,
+                    capacity * sizeof(char *));
+                if (!joined) {
+                    free(copy);
+                    cache->statistics.misses++;
+                    return RESULT_CACHE_MISS;
+                }
+                entry->joined = joined;
+                entry->joined_capacity = capacity;
+            }
+            entry->joined[entry->joined_count++] = copy;
+            cache->statistics.joined++;
+            return RESULT_CACHE_JOINED;
+        }
+        
+        // Its output might never come, e.g. if its server died: the client's
+        // request is dispatched instead, for the clients that joined as well
+        result_cache_unlink_client(cache, entry);
+        result_cache_unlink(&cache->running_newest, &cache->running_oldest, entry);
+        free(entry->client_id);
+    } else {
+        if (cache->count + 1 > cache->capacity &&
+            result_cache_rehash(cache, cache->capacity << 1)) {
+            free(copy);
+            cache->statistics.misses++;
+            return RESULT_CACHE_MISS;
+        }
+        
+        entry = (result_cache_entry_t *) calloc(1, sizeof(result_cache_entry_t));
+        void *request_copy = malloc(request_size ? request_size : 1);
+        if (!entry || !request_copy) {
+            free(entry);
+            free(request_copy);
+            free(copy);
+            cache->statistics.misses++;
+            return RESULT_CACHE_MISS;
+        }
+        
+        entry->request = request_copy;
+        memcpy(entry->request, request, request_size);
+        entry->request_size = request_size;
+        entry->hash = hash;
+        
+        result_cache_entry_t **bucket = &cache->by_request[hash & (cache->capacity - 1)];
+        entry->next_by_request = *bucket;
+        *bucket = entry;
+        cache->count++;
+    }
+    
+    entry->client_id = copy;
+    entry->client_hash = result_cache_hash(client_id, strlen(client_id));
+    entry->time = now;
+    result_cache_link_client(cache, entry);
+    result_cache_link_newest(&cache->running_newest, &cache->running_oldest, entry);
+    
+    cache->statistics.misses++;
+    return RESULT_CACHE_MISS;
+}
+
+char **result_cache_complete(result_cache_t result_cache, const char *client_id,
+    const void *output, size_t output_size, int cacheable, int64_t now,
+    int *joined_count) {
+    _result_cache_t cache = (_result_cache_t) result_cache;
+    result_cache_entry_t *entry = result_cache_find_client(cache, client_id,
+        result_cache_hash(client_id, strlen(client_id)));
+    
+    *joined_count = 0;
+    if (!entry) {
+        return NULL;
+    }
+    
+    char **joined = entry->joined;
+    *joined_count = entry->joined_count;
+    entry->joined = NULL;
+    entry->joined_count = entry->joined_capacity = 0;
+    
+    result_cache_unlink_client(cache, entry);
+    free(entry->client_id);
+    entry->client_id = NULL;
+    
+    entry->output_size = output_size;
+    if (!cacheable || result_cache_entry_size(entry) >
+        cache->max_size / RESULT_CACHE_MAX_OUTPUT_SHARE) {
+        result_cache_remove(cache, entry);
+        return joined;
+    }
+    
+    void *output_copy = malloc(output_size ? output_size : 1);
+    if (!output_copy) {
+        result_cache_remove(cache, entry);
+        return joined;
+    }
+    
+    result_cache_unlink(&cache->running_newest, &cache->running_oldest, entry);
+    entry->output = output_copy;
+    memcpy(entry->output, output, output_size);
+    entry->time = now + cache->ttl_us;
+    result_cache_touch(cache, entry);
+    
+    cache->statistics.entries++;
+    cache->statistics.size += result_cache_entry_size(entry);
+    
+    while (cache->statistics.size > cache->max_size) {
+        cache->statistics.evictions++;
+        result_cache_remove(cache, cache->oldest);
+    }
+    
+    return joined;
+}
+
+char **result_cache_expire(result_cache_t result_cache, int64_t now,
+    int *joined_count) {
+    _result_cache_t cache = (_result_cache_t) result_cache;
+    char **joined = NULL;
+    int capacity = 0;
+    
+    *joined_count = 0;
+    while (cache->running_oldest &&
+        now - cache->running_oldest->time >= cache->ttl_us) {
+        result_cache_entry_t *entry = cache->running_oldest;
+        
+        int needed = *joined_count + entry->joined_count;
+        
+        if (needed > capacity) {
+            capacity = 2 * capacity > needed ? 2 * capacity : needed;
+            char **grown = (char **) realloc(joined, capacity * sizeof(char *));
+            if (!grown) {
+                // The remaining ones are given up on by the next call
+                break;
+            }
+            joined = grown;
+        }
+        
+        if (entry->joined_count) {
+            memcpy(joined + *joined_count, entry->joined,
+                entry->joined_count * sizeof(char *));
+            *joined_count = needed;
+            entry->joined_count = 0;
+        }
+        
+        cache->statistics.abandoned++;
+        result_cache_remove(cache, entry);
+    }
+    
+    return joined;
+}
+
+void result_cache_get_statistics(result_cache_t result_cache,
+    result_cache_statistics_t *statistics) {
+    _result_cache_t cache = (_result_cache_t) result_cache;
+    *statistics = cache->statistics;
+}
@@ -0,0 +1,99 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Cache of the outputs of the clients' requests, keyed by the requests' bytes,
+ for the commands that give the same output every time they run.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef broker_impl_result_cache_h
+#define broker_impl_result_cache_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void *result_cache_t;
+
+/* Outcomes of a lookup */
+typedef enum {
+    /* The output is cached and not expired */
+    RESULT_CACHE_HIT,
+    
+    /* The request has to be dispatched, and its output is expected */
+    RESULT_CACHE_MISS,
+    
+    /* The same request is already dispatched; the client gets its output */
+    RESULT_CACHE_JOINED
+} result_cache_status_t;
+
+typedef struct __result_cache_statistics_t {
+    long hits;
+    long misses;
+    long joined;
+    
+    /* Outputs dropped for the cache's size, or because they expired */
+    long evictions;
+    long expirations;
+    
+    /* Running requests given up on after the TTL */
+    long abandoned;
+    
+    /* Cached outputs and the bytes they take, requests included */
+    long entries;
+    size_t size;
+} result_cache_statistics_t;
+
+/* Creates a new, empty, cache that keeps at most max_size bytes and every
+ * output for ttl_us microseconds */
+result_cache_t result_cache_new(size_t max_size, int64_t ttl_us);
+
+/* Frees the memory occupied by this cache, the waiting clients included */
+void result_cache_delete(result_cache_t cache);
+
+/* Looks up a client's request at time now, in microseconds. On a hit, output
+ * and output_size are the cached output, valid until the next change of the
+ * cache. On a miss or when joining a running request, the cache keeps a copy
+ * of the client's identity, to be handed to result_cache_complete */
+result_cache_status_t result_cache_lookup(result_cache_t cache,
+    const char *client_id, const void *request, size_t request_size,
+    int64_t now, const void **output, size_t *output_size);
+
+/* Stores the output of a client's request, if it missed the cache and the
+ * output is cacheable, evicting the least recently used outputs beyond the
+ * cache's size. Returns the identities of the clients that joined the
+ * request, which the caller must free along with the array, and their number
+ * in joined_count; NULL if none joined */
+char **result_cache_complete(result_cache_t cache, const char *client_id,
+    const void *output, size_t output_size, int cacheable, int64_t now,
+    int *joined_count);
+
+/* Gives up on the requests dispatched at least the TTL before now, e.g. lost
+ * along with their server, so that later lookups dispatch them again. Returns
+ * the identities of the clients that joined them, which the caller must free
+ * along with the array, and their number in joined_count; NULL if none */
+char **result_cache_expire(result_cache_t cache, int64_t now,
+    int *joined_count);
+
+/* Copies the cache's counters */
+void result_cache_get_statistics(result_cache_t cache,
+    result_cache_statistics_t *statistics);
+
+#endif
@@ -25,6 +25,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "worker.h"
 
 /* Weight for various signals used in computing a worker's load */
@@ -35,12 +37,26 @@
 #define MEMORY_LOAD_WEIGHT       0.2
 #define WORKER_BUSY_WEIGHT       1.0
 
+/* Weight of the last completed task in a worker's smoothed task duration */
+#define TASK_DURATION_WEIGHT     0.2
+
+/* Weight of a heartbeat's measured loads against the broker's estimates */
+#define MEASURED_LOAD_WEIGHT     0.5
+
+/* Weight of the last completed task in its command's average costs */
+#define COMMAND_COST_WEIGHT      0.3
+
+/* Commands with measured costs; a command replaces the one with the same slot,
+ * so the table never grows */
+#define COMMAND_COSTS_SIZE       4096
+
 static
 void debug_worker_task(void *key) {
     worker_task_t task = (worker_task_t) key;
-    printf("    task: client_id %s, request |%s|\n",
+    printf("    task: client_id %s, request |%s|, priority %ld\n",
         task->client_id,
-        task->request);
+        task->request,
+        task->priority);
 }
 
 void debug_worker_state(worker_state_t state) {
@@ -49,10 +65,15 @@ void debug_worker_state(worker_state_t state) {
     printf("  assigned tasks %d, completed tasks %d\n",
         state->runtime.assigned_tasks,
         state->runtime.completed_tasks);
-    printf("  worker load %lf %lf %lf\n",
+    printf("  worker resources %ld %ld %ld\n",
+        state->runtime.cpu,
+        state->runtime.memory,
+        state->runtime.network);
+    printf("  worker load %lf %lf %lf, run queue %.1lf\n",
         state->runtime.cpu_load,
         state->runtime.memory_load,
-        state->runtime.network_load);
+        state->runtime.network_load,
+        state->runtime.run_queue);
     
     printf("  tasks\n");
     queue_iterate(state->tasks, debug_worker_task);
@@ -64,9 +85,97 @@ worker_task_t new_task(char *client_id, char *request) {
         malloc(sizeof(struct __worker_task_t));
     result->client_id = client_id;
     result->request = request;
+    result->payload = NULL;
+    result->priority = QUEUE_DEFAULT_PRIORITY;
+    result->enqueue_time = 0;
+    result->command = get_command_key(request);
+    estimate_request(request, &result->cpu, &result->memory, &result->network);
+    return result;
+}
+
+int worker_push_task(worker_state_t state, worker_task_t task) {
+    if (queue_get_balancing_policy(state->tasks) == MPSC_FIFO) {
+        // Lock-free, it never waits for the consumer
+        return queue_push(state->tasks, task);
+    }
+    
+    pthread_mutex_lock (&state->mutex);
+    int result = queue_push_priority(state->tasks, task, task->priority);
+    pthread_mutex_unlock (&state->mutex);
+    
     return result;
 }
 
+worker_task_t worker_pop_task(worker_state_t state) {
+    if (queue_get_balancing_policy(state->tasks) == MPSC_FIFO) {
+        return (worker_task_t) queue_pop(state->tasks);
+    }
+    
+    pthread_mutex_lock (&state->mutex);
+    worker_task_t task = (worker_task_t) queue_pop(state->tasks);
+    pthread_mutex_unlock (&state->mutex);
+    
+    return task;
+}
+
+worker_task_t worker_take_task(worker_state_t state) {
+    worker_task_t task = worker_pop_task(state);
+    if (!task) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock (&state->mutex);
+    state->runtime.assigned_tasks--;
+    charge_worker_task(&state->runtime, task, -1);
+    pthread_mutex_unlock (&state->mutex);
+    
+    return task;
+}
+
+int worker_track_task(worker_state_t state, worker_task_t task, int64_t now) {
+    if (state->in_flight == state->in_flight_capacity) {
+        int capacity = state->in_flight_capacity ? 2 * state->in_flight_capacity : 4;
+        worker_task_t *tasks = (worker_task_t *) realloc(state->in_flight_tasks,
+            capacity * sizeof(worker_task_t));
+        if (!tasks) {
+            return -1;
+        }
+        state->in_flight_tasks = tasks;
+        state->in_flight_capacity = capacity;
+    }
+    
+    worker_task_t record = (worker_task_t) malloc(sizeof(struct __worker_task_t));
+    char *client_id = strdup(task->client_id);
+    if (!record || !client_id) {
+        free(record);
+        free(client_id);
+        return -1;
+    }
+    
+    *record = *task;
+    record->client_id = client_id;
+    record->request = NULL;
+    record->payload = NULL;
+    record->enqueue_time = now;
+    state->in_flight_tasks[state->in_flight++] = record;
+    
+    return 0;
+}
+
+worker_task_t worker_untrack_task(worker_state_t state, const char *client_id) {
+    int it;
+    
+    for (it = 0; it < state->in_flight; it++) {
+        worker_task_t record = state->in_flight_tasks[it];
+        if (!strcmp(record->client_id, client_id)) {
+            state->in_flight_tasks[it] = state->in_flight_tasks[--state->in_flight];
+            return record;
+        }
+    }
+    
+    return NULL;
+}
+
 void init_default_runtime_settings(worker_statistics_t *runtime) {
     if (!runtime) {
         return;
@@ -75,8 +184,26 @@ void init_default_runtime_settings(worker_statistics_t *runtime) {
     runtime->completed_tasks = 0;
     runtime->cpu = DEFAULT_RESOURCE_CPU;
     runtime->memory = DEFAULT_RESOURCE_MEMORY;
-    runtime->network = DEFAULT_RESOURCE_NETWORK;
+    runtime->network = 0;
     runtime->cpu_load = runtime->memory_load = runtime->network_load = 0.0;
+    runtime->task_duration = 0.0;
+    runtime->run_queue = 0.0;
+}
+
+void set_worker_capacity(worker_statistics_t *runtime, long cpu, long memory,
+    long network) {
+    if (cpu > 0) {
+        runtime->cpu_load *= (double) runtime->cpu / cpu;
+        runtime->cpu = cpu;
+    }
+    if (memory > 0) {
+        runtime->memory_load *= (double) runtime->memory / memory;
+        runtime->memory = memory;
+    }
+    if (network > 0) {
+        runtime->network_load *= (double) runtime->network / network;
+        runtime->network = network;
+    }
 }
 
 double get_runtime_effort(worker_statistics_t *runtime,
@@ -88,7 +215,10 @@ double get_runtime_effort(worker_statistics_t *runtime,
     
     double score = 0.0;
     
-    score += ASSIGNED_TASKS_WEIGHT * runtime->assigned_tasks;
+    // The loads are fractions of the worker's resources already; its tasks
+    // weigh less on a machine with more CPUs than the default one
+    score += ASSIGNED_TASKS_WEIGHT * runtime->assigned_tasks *
+        DEFAULT_RESOURCE_CPU / runtime->cpu;
     score += COMPLETED_TASKS_WEIGHT * runtime->completed_tasks;
     score += CPU_LOAD_WEIGHT * runtime->cpu_load;
     score += NETWORK_LOAD_WEIGHT * runtime->network_load;
@@ -101,35 +231,278 @@ double get_runtime_effort(worker_statistics_t *runtime,
     return score;
 }
 
-#include <string.h>
+/* Moving averages of a command's costs, in the units of the workers'
+ * resources */
+typedef struct __command_cost_t {
+    double cpu;
+    double memory;
+    double wall_time;
+} command_cost_t;
 
-void estimate_request(char *request, long *cpu, long *memory, long *network) {
-    if (request && strstr(request, "ping") == request) {
-        *cpu = DEFAULT_RESOURCE_CPU;
-        *memory = DEFAULT_RESOURCE_MEMORY;
-        *network = DEFAULT_RESOURCE_NETWORK;
+/* A command's entry in the costs table, shared by the I/O thread, which
+ * estimates the new tasks, and the shards, which record the completed ones.
+ * It is a sequence lock: the sequence is odd while a thread writes the entry,
+ * and the readers retry if it changed while they read */
+typedef struct __command_cost_entry_t {
+    atomic_uint sequence;
+    _Atomic uint32_t command;
+    atomic_int samples;
+    _Atomic double cpu;
+    _Atomic double memory;
+    _Atomic double wall_time;
+} command_cost_entry_t;
+
+static command_cost_entry_t command_costs[COMMAND_COSTS_SIZE];
+
+uint32_t get_command_key(char *request) {
+    uint32_t hash = 2166136261u;
+    char previous = ' ';
+    
+    while (request && *request) {
+        char c = *request++;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            c = ' ';
+        } else if (c >= '0' && c <= '9') {
+            c = '#';
+        }
+        // A run of blanks or digits counts once, leading blanks not at all
+        if ((c == ' ' || c == '#') && c == previous) {
+            continue;
+        }
+        hash ^= (unsigned char) c;
+        hash *= 16777619u;
+        previous = c;
+    }
+    
+    return hash ? hash : 1;
+}
+
+void record_command_cost(uint32_t command, long wall_time, long cpu_time,
+    long max_rss) {
+    // CPUs kept busy on average, and megabytes
+    double cpu = wall_time > 0 ?
+        (double) cpu_time / wall_time * RESOURCE_CPU_PER_CORE : 0.0;
+    double memory = max_rss / 1024.0;
+    double duration = wall_time;
+    command_cost_entry_t *entry = &command_costs[command % COMMAND_COSTS_SIZE];
+    
+    // A sample that comes while another shard writes the same entry is
+    // dropped rather than waited for
+    unsigned int sequence = atomic_load_explicit(&entry->sequence,
+        memory_order_relaxed);
+    if ((sequence & 1) || !atomic_compare_exchange_strong_explicit(
+        &entry->sequence, &sequence, sequence + 1, memory_order_acquire,
+        memory_order_relaxed)) {
         return;
     }
-    /* Some default estimates ... */
+    atomic_thread_fence(memory_order_release);
+    
+    if (atomic_load_explicit(&entry->command, memory_order_relaxed) != command ||
+        !atomic_load_explicit(&entry->samples, memory_order_relaxed)) {
+        atomic_store_explicit(&entry->command, command, memory_order_relaxed);
+        atomic_store_explicit(&entry->samples, 0, memory_order_relaxed);
+    } else {
+        double average;
+        average = atomic_load_explicit(&entry->cpu, memory_order_relaxed);
+        cpu = average + COMMAND_COST_WEIGHT * (cpu - average);
+        average = atomic_load_explicit(&entry->memory, memory_order_relaxed);
+        memory = average + COMMAND_COST_WEIGHT * (memory - average);
+        average = atomic_load_explicit(&entry->wall_time, memory_order_relaxed);
+        duration = average + COMMAND_COST_WEIGHT * (duration - average);
+    }
+    atomic_store_explicit(&entry->cpu, cpu, memory_order_relaxed);
+    atomic_store_explicit(&entry->memory, memory, memory_order_relaxed);
+    atomic_store_explicit(&entry->wall_time, duration, memory_order_relaxed);
+    atomic_fetch_add_explicit(&entry->samples, 1, memory_order_relaxed);
+    
+    atomic_store_explicit(&entry->sequence, sequence + 2, memory_order_release);
+}
+
+/* Copies a command's average costs; returns 0 if the command did not complete
+ * yet, or its entry went to another command since */
+static
+int lookup_command_cost(uint32_t command, command_cost_t *cost) {
+    command_cost_entry_t *entry = &command_costs[command % COMMAND_COSTS_SIZE];
+    unsigned int sequence;
+    int found;
+    
+    do {
+        sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+        
+        found = atomic_load_explicit(&entry->command, memory_order_relaxed) ==
+            command && atomic_load_explicit(&entry->samples, memory_order_relaxed);
+        cost->cpu = atomic_load_explicit(&entry->cpu, memory_order_relaxed);
+        cost->memory = atomic_load_explicit(&entry->memory, memory_order_relaxed);
+        cost->wall_time = atomic_load_explicit(&entry->wall_time,
+            memory_order_relaxed);
+        
+        atomic_thread_fence(memory_order_acquire);
+    } while ((sequence & 1) ||
+        atomic_load_explicit(&entry->sequence, memory_order_relaxed) != sequence);
+    
+    return found;
+}
+
+void estimate_request(char *request, long *cpu, long *memory, long *network) {
+    command_cost_t cost;
+    
+    /* Some default estimates, until the command completes once; the memory
+     * and the network are charged as a share of the worker's own ... */
     *cpu = 0.2 * DEFAULT_RESOURCE_CPU;
-    *memory = 0.2 * DEFAULT_RESOURCE_MEMORY;
-    *network = 0.2 * DEFAULT_RESOURCE_NETWORK;
+    *memory = TASK_COST_UNKNOWN;
+    *network = TASK_COST_UNKNOWN;
+    
+    /* ... then the measured ones; the network is not measured */
+    if (lookup_command_cost(get_command_key(request), &cost)) {
+        *cpu = (long) cost.cpu;
+        *memory = (long) cost.memory;
+    }
+}
+
+int get_task_size_class(char *request) {
+    command_cost_t cost;
+    
+    /* Tasks whose command ran for long are large; the others, and the ones
+     * that never completed, are small */
+    if (lookup_command_cost(get_command_key(request), &cost) &&
+        cost.wall_time >= LARGE_TASK_WALL_TIME_US) {
+        return 1;
+    }
+    
+    return 0;
+}
+
+/* Adds (sign 1) or removes (sign -1) the given resources to a worker's load,
+ * along with DEFAULT_TASK_SHARE of its memory and network for each task whose
+ * cost of that resource is not known */
+static
+void apply_runtime_delta(worker_statistics_t *runtime,
+    long cpu, long memory, long network, int unknown_memory,
+    int unknown_network, int sign) {
+    runtime->cpu_load += sign * ((double) cpu / runtime->cpu);
+    runtime->memory_load += sign * ((double) memory / runtime->memory +
+        unknown_memory * DEFAULT_TASK_SHARE);
+    if (runtime->network) {
+        runtime->network_load += sign * ((double) network / runtime->network +
+            unknown_network * DEFAULT_TASK_SHARE);
+    }
 }
 
 void update_worker_runtime(worker_statistics_t *runtime, char *request,
     int sign) {
+    struct __worker_task_t task;
+    
+    estimate_request(request, &task.cpu, &task.memory, &task.network);
+    
+    charge_worker_task(runtime, &task, sign);
+}
+
+void charge_worker_task(worker_statistics_t *runtime, worker_task_t task,
+    int sign) {
     
     if (sign == 1) {
         runtime->assigned_tasks++;
     }
     
-    long cpu, memory, network;
+    int unknown_memory = task->memory == TASK_COST_UNKNOWN;
+    int unknown_network = task->network == TASK_COST_UNKNOWN;
+    apply_runtime_delta(runtime, task->cpu,
+        unknown_memory ? 0 : task->memory, unknown_network ? 0 : task->network,
+        unknown_memory, unknown_network, sign);
+    
+    // The measured loads might be lower than the estimates of the tasks
+    // that were running at the time
+    if (sign == -1) {
+        if (runtime->cpu_load < 0.0) {
+            runtime->cpu_load = 0.0;
+        }
+        if (runtime->memory_load < 0.0) {
+            runtime->memory_load = 0.0;
+        }
+        if (runtime->network_load < 0.0) {
+            runtime->network_load = 0.0;
+        }
+    }
+}
+
+void blend_measured_load(worker_statistics_t *runtime, double cpu_load,
+    double memory_load, double run_queue) {
+    double cpus = (double) runtime->cpu / RESOURCE_CPU_PER_CORE;
+    if (cpus < 1.0) {
+        cpus = 1.0;
+    }
+    
+    // A saturated machine is 100% busy, however many processes wait
+    if (run_queue / cpus > cpu_load) {
+        cpu_load = run_queue / cpus;
+    }
+    
+    runtime->cpu_load += MEASURED_LOAD_WEIGHT * (cpu_load - runtime->cpu_load);
+    runtime->memory_load += MEASURED_LOAD_WEIGHT *
+        (memory_load - runtime->memory_load);
+    runtime->run_queue = run_queue;
+}
+
+void record_task_duration(worker_statistics_t *runtime, double duration) {
+    if (runtime->task_duration == 0.0) {
+        runtime->task_duration = duration;
+    } else {
+        runtime->task_duration += TASK_DURATION_WEIGHT *
+            (duration - runtime->task_duration);
+    }
+}
+
+/* Sum of the estimates of the tasks moved by the current relocation; the
+ * shards relocate tasks concurrently, so every thread has its own sums */
+static _Thread_local long relocated_cpu, relocated_memory, relocated_network;
+static _Thread_local int relocated_unknown_memory, relocated_unknown_network;
+
+static
+void accumulate_relocated_task(void *key) {
+    worker_task_t task = (worker_task_t) key;
+    
+    relocated_cpu += task->cpu;
+    if (task->memory == TASK_COST_UNKNOWN) {
+        relocated_unknown_memory++;
+    } else {
+        relocated_memory += task->memory;
+    }
+    if (task->network == TASK_COST_UNKNOWN) {
+        relocated_unknown_network++;
+    } else {
+        relocated_network += task->network;
+    }
+}
+
+unsigned int relocate_worker_tasks(worker_state_t src, worker_state_t dst,
+    unsigned int tasks_count) {
+    
+    // Always lock the two workers in the same order
+    worker_state_t first = src < dst ? src : dst;
+    worker_state_t second = src < dst ? dst : src;
     
-    estimate_request(request, &cpu, &memory, &network);
+    relocated_cpu = relocated_memory = relocated_network = 0;
+    relocated_unknown_memory = relocated_unknown_network = 0;
     
-    runtime->cpu_load += sign * ((double) cpu / runtime->cpu);
-    runtime->memory_load += sign * ((double) memory / runtime->memory);
-    runtime->network_load += sign * ((double) network / runtime->network);
+    pthread_mutex_lock (&first->mutex);
+    pthread_mutex_lock (&second->mutex);
+    
+    unsigned int moved = queue_splice(src->tasks, dst->tasks, tasks_count,
+        accumulate_relocated_task);
+    
+    src->runtime.assigned_tasks -= moved;
+    dst->runtime.assigned_tasks += moved;
+    apply_runtime_delta(&src->runtime,
+        relocated_cpu, relocated_memory, relocated_network,
+        relocated_unknown_memory, relocated_unknown_network, -1);
+    apply_runtime_delta(&dst->runtime,
+        relocated_cpu, relocated_memory, relocated_network,
+        relocated_unknown_memory, relocated_unknown_network, 1);
+    
+    pthread_mutex_unlock (&second->mutex);
+    pthread_mutex_unlock (&first->mutex);
+    
+    return moved;
 }
 
 double get_runtime_load(worker_statistics_t *runtime) {
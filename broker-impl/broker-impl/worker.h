@@ -28,13 +28,39 @@
 #define broker_impl_worker_h
 
 #include "queue.h"
+#include <stdint.h>
 #include <pthread.h>
-#include <libkern/OSAtomic.h>
 
+/* Bytes of a request the cost estimates look at */
+#define REQUEST_HEAD_SIZE                     256
 
 typedef struct __worker_task_t {
     char *client_id;
+    
+    /* Head of the request, at most REQUEST_HEAD_SIZE bytes, for the cost
+     * estimates */
     char *request;
+    
+    /* Frame with the whole request, sent to the server as received from the
+     * client; owned by the task, NULL if the task has only its head */
+    void *payload;
+    
+    /* Dispatch priority, lower values first: the task's absolute deadline, in
+     * milliseconds, or QUEUE_DEFAULT_PRIORITY if it has none */
+    long priority;
+    
+    /* Time when the broker received the task, in microseconds */
+    int64_t enqueue_time;
+    
+    /* Normalized hash of the command, the key of its measured costs */
+    uint32_t command;
+    
+    /* Resources charged to the worker the task is assigned to, estimated once
+     * when the task is created, so that the same amounts are withdrawn; or
+     * TASK_COST_UNKNOWN */
+    long cpu;
+    long memory;
+    long network;
 } *worker_task_t;
 
 typedef enum  {
@@ -45,14 +71,24 @@ typedef enum  {
 
 #define INVALID_WORKER_ID                      -1
 
+/* Credits of a server that does not advertise any, i.e. one task at a time */
+#define DEFAULT_WORKER_CREDITS                  1
+
 /* Available CPU cycles per second */
 #define DEFAULT_RESOURCE_CPU                10000
 
+/* CPU cycles per second of one online CPU; the default is a four CPUs machine */
+#define RESOURCE_CPU_PER_CORE               (DEFAULT_RESOURCE_CPU / 4)
+
 /* Available memory in megabytes */
 #define DEFAULT_RESOURCE_MEMORY             10000
 
-/* Available network bandwidth, in megabytes per second */
-#define DEFAULT_RESOURCE_NETWORK            10000
+/* Cost of a task that is not known yet, e.g. because it is not measured: the
+ * task is charged DEFAULT_TASK_SHARE of the worker's resource instead */
+#define TASK_COST_UNKNOWN                   -1
+
+/* Share of a worker's resource charged for a task of unknown cost */
+#define DEFAULT_TASK_SHARE                  0.2
 
 
 /* Worker's maximum load for which it is recommended to become IDLE */
@@ -70,7 +106,8 @@ typedef enum  {
 
 
 typedef struct __worker_statistics_t {
-    /* Available worker's resources */
+    /* Available worker's resources; the network bandwidth, in megabytes per
+     * second, is 0 until the server advertises it, and is not charged */
     long network;
     long memory;
     long cpu;
@@ -85,14 +122,39 @@ typedef struct __worker_statistics_t {
     
     /* Number of completed tasks */
     int completed_tasks;
+    
+    /* Smoothed time between a task's dispatch and its reply, in microseconds;
+     * 0 until the first reply */
+    double task_duration;
+    
+    /* Runnable processes on the server, as of its last heartbeat */
+    double run_queue;
 } worker_statistics_t;
 
 typedef struct __worker_state_t {
     char *worker_id;
+    
+    /* BUSY while the worker has as many tasks in flight as credits */
     worker_status_t status;
+    
     queue_t tasks;
     pthread_mutex_t mutex;
     worker_statistics_t runtime;
+    
+    /* Tasks the server runs at once, advertised in its READY message, and
+     * tasks sent to the server whose replies did not arrive yet */
+    int credits;
+    int in_flight;
+    
+    /* Records of the tasks in flight, the first in_flight ones: their
+     * clients' identities and their charges, with their dispatch times, in
+     * microseconds, as enqueue_time */
+    worker_task_t *in_flight_tasks;
+    int in_flight_capacity;
+    
+    /* Largest number of tasks the server accepts in one message; servers that
+     * do not advertise credits take one task at a time */
+    int max_batch;
 } *worker_state_t;
 
 void debug_worker_state(worker_state_t state);
@@ -100,15 +162,92 @@ void debug_worker_state(worker_state_t state);
 /* Creates a new task */
 worker_task_t new_task(char *client_id, char *request);
 
+/* Adds a task to a worker's queue, ordered by the task's priority if the queue
+ * is a PRIORITY one; returns 0 for success */
+int worker_push_task(worker_state_t state, worker_task_t task);
+
+/* Removes the next task to be dispatched from a worker's queue; the caller
+ * must be the queue's only consumer. Returns NULL if there is none. */
+worker_task_t worker_pop_task(worker_state_t state);
+
+/* Removes the next task from a worker's queue, along with its share of the
+ * worker's load, e.g. to hand it to another shard; the caller must be the
+ * queue's only consumer. Returns NULL if there is none. */
+worker_task_t worker_take_task(worker_state_t state);
+
+/* Records a task sent to the worker's server at time now, in microseconds,
+ * and counts it in flight; the record keeps a copy of the client's identity
+ * and of the task's charges. Returns 0 for success */
+int worker_track_task(worker_state_t state, worker_task_t task, int64_t now);
+
+/* Removes the record of a client's task in flight and returns it, or NULL if
+ * there is none; the caller frees the record and its client's identity */
+worker_task_t worker_untrack_task(worker_state_t state, const char *client_id);
+
 /* Initializes the default runtime settings for a worker */
 void init_default_runtime_settings(worker_statistics_t *runtime);
 
+/* Sets a worker's available resources to the ones its server advertised,
+ * keeping the current value of those that are 0, and rescales its load to
+ * them */
+void set_worker_capacity(worker_statistics_t *runtime, long cpu, long memory,
+    long network);
+
 /* Returns the runtime effort, e.g. load, of a worker */
 double get_runtime_effort(worker_statistics_t *runtime, worker_status_t status);
 
 /* Updates the worker's runtime information */
 void update_worker_runtime(worker_statistics_t *runtime, char *request, int sign);
 
+/* Adds (sign 1) or withdraws (sign -1) the resources charged for a task to
+ * the worker's runtime information */
+void charge_worker_task(worker_statistics_t *runtime, worker_task_t task,
+    int sign);
+
+/* Estimates the resources a request needs: its command's measured costs, if
+ * it completed before, or a fifth of the default machine's CPUs and
+ * TASK_COST_UNKNOWN for the other resources. The network is never measured */
+void estimate_request(char *request, long *cpu, long *memory, long *network);
+
+/* Returns the normalized hash of a request's command, with runs of blanks
+ * collapsed and runs of digits folded, so that e.g. "sleep 1" and "sleep 2"
+ * share their costs; never 0 */
+uint32_t get_command_key(char *request);
+
+/* Adds a completed task's costs, measured by its server, to the command's
+ * moving averages: wall and CPU time, in microseconds, and maximum resident
+ * set size, in kilobytes */
+void record_command_cost(uint32_t command, long wall_time, long cpu_time,
+    long max_rss);
+
+/* Moves the worker's estimated loads toward the ones its server measured:
+ * the fraction of its CPUs that was busy, or of runnable processes per CPU if
+ * larger, and the fraction of its memory in use; the network load is not
+ * measured */
+void blend_measured_load(worker_statistics_t *runtime, double cpu_load,
+    double memory_load, double run_queue);
+
+/* Adds the duration of a completed task, in microseconds, to the worker's
+ * smoothed task duration */
+void record_task_duration(worker_statistics_t *runtime, double duration);
+
+/* Moves up to tasks_count tasks from src's queue to dst's queue in one splice
+ * and updates both workers' runtime with the aggregated estimates of the moved
+ * tasks; the caller must hold the mutex of the workers' shard. Returns the
+ * number of moved tasks. */
+unsigned int relocate_worker_tasks(worker_state_t src, worker_state_t dst,
+    unsigned int tasks_count);
+
+/* Number of tasks size classes, see get_task_size_class */
+#define TASK_SIZE_CLASSES                       2
+
+/* Average run time, in microseconds, from which a command's tasks are large */
+#define LARGE_TASK_WALL_TIME_US                 1000000
+
+/* Returns the size class of a request, from 0 for the shortest tasks to
+ * TASK_SIZE_CLASSES - 1, based on its command's measured run time */
+int get_task_size_class(char *request);
+
 /* Returns a double in [0, 1.0] proportional with the worker's current load */
 double get_runtime_load(worker_statistics_t *runtime);
 
@@ -0,0 +1,357 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Index over the broker's workers, used to pick a worker for a new task or for
+ a dispatch without scanning all the workers.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "worker_index.h"
+
+#define WORKER_INDEX_MIN_CAPACITY      64
+#define BITS_PER_WORD                  (8 * sizeof(unsigned long))
+
+/* Binary min-heap of worker ids, with the position of every worker in the
+ * heap so that its key can be updated in place; ties go to the lowest id */
+typedef struct __indexed_heap_t {
+    int *heap;          // Worker ids, in heap order
+    double *key;        // Key of every worker id
+    int *position;      // Position of every worker id in heap, -1 if absent
+    int size;
+} indexed_heap_t;
+
+typedef struct __worker_index_t {
+    int capacity;
+    
+    // Workers that are neither IDLE nor full loaded, keyed by load
+    indexed_heap_t load_heap;
+    
+    // Workers that are not DEAD, keyed by runtime effort
+    indexed_heap_t effort_heap;
+    
+    // Workers that are not DEAD and have queued tasks, longest queue first
+    indexed_heap_t backlog_heap;
+    
+    // One bit for every AVAILABLE worker with queued tasks
+    unsigned long *dispatchable;
+    int dispatch_cursor;
+    
+    // One bit for every AVAILABLE worker without queued tasks
+    unsigned long *idle;
+    int idle_cursor;
+} *_worker_index_t;
+
+/* Returns 1 if the first worker has to be on top of the second one */
+static inline
+int heap_before(indexed_heap_t *h, int worker1, int worker2) {
+    return h->key[worker1] < h->key[worker2] ||
+        (h->key[worker1] == h->key[worker2] && worker1 < worker2);
+}
+
+static inline
+void heap_place(indexed_heap_t *h, int position, int worker_id) {
+    h->heap[position] = worker_id;
+    h->position[worker_id] = position;
+}
+
+static
+void heap_sift_up(indexed_heap_t *h, int position) {
+    int worker_id = h->heap[position];
+    
+    while (position > 0) {
+        int parent = (position - 1) >> 1;
+        if (!heap_before(h, worker_id, h->heap[parent])) {
+            break;
+        }
+        heap_place(h, position, h->heap[parent]);
+        position = parent;
+    }
+    
+    heap_place(h, position, worker_id);
+}
+
+static
+void heap_sift_down(indexed_heap_t *h, int position) {
+    int worker_id = h->heap[position];
+    
+    while (1) {
+        int child = (position << 1) + 1;
+        if (child >= h->size) {
+            break;
+        }
+        if (child + 1 < h->size && heap_before(h, h->heap[child + 1], h->heap[child])) {
+            child++;
+        }
+        if (!heap_before(h, h->heap[child], worker_id)) {
+            break;
+        }
+        heap_place(h, position, h->heap[child]);
+        position = child;
+    }
+    
+    heap_place(h, position, worker_id);
+}
+
+/* Inserts a worker or updates its key */
+static
+void heap_set(indexed_heap_t *h, int worker_id, double key) {
+    h->key[worker_id] = key;
+    
+    int position = h->position[worker_id];
+    if (position < 0) {
+        position = h->size++;
+        heap_place(h, position, worker_id);
+    }
+    
+    heap_sift_up(h, position);
+    heap_sift_down(h, h->position[worker_id]);
+}
+
+static
+void heap_remove(indexed_heap_t *h, int worker_id) {
+    int position = h->position[worker_id];
+    if (position < 0) {
+        return;
+    }
+    
+    h->position[worker_id] = -1;
+    h->size--;
+    
+    if (position < h->size) {
+        int moved = h->heap[h->size];
+        heap_place(h, position, moved);
+        heap_sift_up(h, position);
+        heap_sift_down(h, h->position[moved]);
+    }
+}
+
+static
+int heap_resize(indexed_heap_t *h, int old_capacity, int capacity) {
+    int *heap = (int *) realloc(h->heap, capacity * sizeof(int));
+    if (!heap) {
+        return -1;
+    }
+    h->heap = heap;
+    
+    double *key = (double *) realloc(h->key, capacity * sizeof(double));
+    if (!key) {
+        return -1;
+    }
+    h->key = key;
+    
+    int *position = (int *) realloc(h->position, capacity * sizeof(int));
+    if (!position) {
+        return -1;
+    }
+    h->position = position;
+    
+    int it;
+    for (it = old_capacity; it < capacity; it++) {
+        h->position[it] = -1;
+    }
+    
+    return 0;
+}
+
+static
+int bitmap_resize(unsigned long **bitmap, int old_capacity, int capacity) {
+    int old_words = (old_capacity + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    int words = (capacity + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    
+    unsigned long *result = (unsigned long *) realloc(*bitmap,
+        words * sizeof(unsigned long));
+    if (!result) {
+        return -1;
+    }
+    memset(result + old_words, 0, (words - old_words) * sizeof(unsigned long));
+    *bitmap = result;
+    
+    return 0;
+}
+
+static inline
+void bitmap_set(unsigned long *bitmap, int worker_id, int value) {
+    unsigned long mask = 1UL << (worker_id % BITS_PER_WORD);
+    
+    if (value) {
+        bitmap[worker_id / BITS_PER_WORD] |= mask;
+    } else {
+        bitmap[worker_id / BITS_PER_WORD] &= ~mask;
+    }
+}
+
+/* Returns the first set bit at or after the cursor, wrapping around, and moves
+ * the cursor after it; INVALID_WORKER_ID if there is none */
+static
+int bitmap_next(unsigned long *bitmap, int capacity, int *cursor) {
+    int words = (capacity + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    int start = *cursor;
+    int it;
+    
+    // Visit the word of the cursor twice: first its bits from the cursor on,
+    // and, after wrapping around, its bits before the cursor
+    for (it = 0; it <= words; it++) {
+        int word_id = (start / BITS_PER_WORD + it) % words;
+        unsigned long word = bitmap[word_id];
+        
+        if (it == 0) {
+            word &= ~0UL << (start % BITS_PER_WORD);
+        }
+        
+        if (word) {
+            int worker_id = word_id * BITS_PER_WORD + ffsl((long) word) - 1;
+            *cursor = (worker_id + 1) % capacity;
+            return worker_id;
+        }
+    }
+    
+    return INVALID_WORKER_ID;
+}
+
+/* Makes room for worker_id in every structure of the index */
+static
+int worker_index_reserve(_worker_index_t index, int worker_id) {
+    if (worker_id < index->capacity) {
+        return 0;
+    }
+    
+    int capacity = index->capacity ? index->capacity : WORKER_INDEX_MIN_CAPACITY;
+    while (capacity <= worker_id) {
+        capacity <<= 1;
+    }
+    
+    if (heap_resize(&index->load_heap, index->capacity, capacity) ||
+        heap_resize(&index->effort_heap, index->capacity, capacity) ||
+        heap_resize(&index->backlog_heap, index->capacity, capacity)) {
+        return -1;
+    }
+    
+    if (bitmap_resize(&index->dispatchable, index->capacity, capacity) ||
+        bitmap_resize(&index->idle, index->capacity, capacity)) {
+        return -1;
+    }
+    
+    index->capacity = capacity;
+    return 0;
+}
+
+worker_index_t worker_index_new(void) {
+    _worker_index_t index = (_worker_index_t) calloc(1, sizeof(struct __worker_index_t));
+    if (!index) {
+        return NULL;
+    }
+    
+    if (worker_index_reserve(index, WORKER_INDEX_MIN_CAPACITY - 1)) {
+        worker_index_delete(index);
+        return NULL;
+    }
+    
+    return index;
+}
+
+void worker_index_delete(worker_index_t worker_index) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    if (!index) {
+        return;
+    }
+    
+    free(index->load_heap.heap);
+    free(index->load_heap.key);
+    free(index->load_heap.position);
+    free(index->effort_heap.heap);
+    free(index->effort_heap.key);
+    free(index->effort_heap.position);
+    free(index->backlog_heap.heap);
+    free(index->backlog_heap.key);
+    free(index->backlog_heap.position);
+    free(index->dispatchable);
+    free(index->idle);
+    free(index);
+}
+
+int worker_index_update(worker_index_t worker_index, int worker_id,
+    worker_state_t state) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    
+    if (!index || !state || worker_id < 0 ||
+        worker_index_reserve(index, worker_id)) {
+        return -1;
+    }
+    
+    if (state->status == DEAD) {
+        heap_remove(&index->load_heap, worker_id);
+        heap_remove(&index->effort_heap, worker_id);
+        heap_remove(&index->backlog_heap, worker_id);
+        bitmap_set(index->dispatchable, worker_id, 0);
+        bitmap_set(index->idle, worker_id, 0);
+        return 0;
+    }
+    
+    double load = get_runtime_load(&state->runtime);
+    if (load > 0.0 && load < 1.0) {
+        heap_set(&index->load_heap, worker_id, load);
+    } else {
+        heap_remove(&index->load_heap, worker_id);
+    }
+    
+    heap_set(&index->effort_heap, worker_id,
+        get_runtime_effort(&state->runtime, state->status));
+    
+    int queued = queue_get_size(state->tasks);
+    if (queued > 0) {
+        heap_set(&index->backlog_heap, worker_id, -(double) queued);
+    } else {
+        heap_remove(&index->backlog_heap, worker_id);
+    }
+    
+    bitmap_set(index->dispatchable, worker_id, state->status == AVAILABLE && queued > 0);
+    bitmap_set(index->idle, worker_id, state->status == AVAILABLE && queued == 0);
+    
+    return 0;
+}
+
+int worker_index_least_loaded(worker_index_t worker_index) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    return index->load_heap.size ? index->load_heap.heap[0] : INVALID_WORKER_ID;
+}
+
+int worker_index_least_effort(worker_index_t worker_index) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    return index->effort_heap.size ? index->effort_heap.heap[0] : INVALID_WORKER_ID;
+}
+
+int worker_index_most_backlogged(worker_index_t worker_index) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    return index->backlog_heap.size ? index->backlog_heap.heap[0] : INVALID_WORKER_ID;
+}
+
+int worker_index_next_dispatchable(worker_index_t worker_index) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    return bitmap_next(index->dispatchable, index->capacity, &index->dispatch_cursor);
+}
+
+int worker_index_next_idle(worker_index_t worker_index) {
+    _worker_index_t index = (_worker_index_t) worker_index;
+    return bitmap_next(index->idle, index->capacity, &index->idle_cursor);
+}
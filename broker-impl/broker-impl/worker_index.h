@@ -0,0 +1,65 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Index over the broker's workers, used to pick a worker for a new task or for
+ a dispatch without scanning all the workers.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef broker_impl_worker_index_h
+#define broker_impl_worker_index_h
+
+#include "worker.h"
+
+typedef void *worker_index_t;
+
+/* Creates a new, empty, index */
+worker_index_t worker_index_new(void);
+
+/* Frees the memory occupied by this index */
+void worker_index_delete(worker_index_t index);
+
+/* Recomputes the keys of a worker after its status, runtime or tasks queue
+ * changed, in O(log n); returns 0 for success */
+int worker_index_update(worker_index_t index, int worker_id,
+    worker_state_t state);
+
+/* Returns the worker with the least load among the workers that are neither
+ * IDLE (no load at all) nor full loaded, or INVALID_WORKER_ID */
+int worker_index_least_loaded(worker_index_t index);
+
+/* Returns the worker with the least runtime effort, or INVALID_WORKER_ID */
+int worker_index_least_effort(worker_index_t index);
+
+/* Returns the worker with the most queued tasks, or INVALID_WORKER_ID if no
+ * worker has queued tasks */
+int worker_index_most_backlogged(worker_index_t index);
+
+/* Returns an AVAILABLE worker with queued tasks, or INVALID_WORKER_ID; the
+ * search resumes after the last returned worker, so that all the workers get
+ * dispatches */
+int worker_index_next_dispatchable(worker_index_t index);
+
+/* Returns an AVAILABLE worker without queued tasks, or INVALID_WORKER_ID; the
+ * search resumes after the last returned worker */
+int worker_index_next_idle(worker_index_t index);
+
+#endif
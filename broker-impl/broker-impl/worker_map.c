@@ -0,0 +1,215 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Hash table from the servers' identities to the broker's worker slots, used to
+ find the worker of a reply without scanning all the workers.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "worker_map.h"
+
+#define WORKER_MAP_MIN_CAPACITY        64
+
+/* Slots are either empty, in use or deleted (tombstones, which keep the
+ * probing sequences of the other identities intact) */
+#define WORKER_MAP_EMPTY               -1
+#define WORKER_MAP_DELETED             -2
+
+typedef struct __worker_map_entry_t {
+    const char *identity;
+    uint32_t hash;
+    int worker_id;      // WORKER_MAP_EMPTY, WORKER_MAP_DELETED or the slot
+} worker_map_entry_t;
+
+typedef struct __worker_map_t {
+    worker_map_entry_t *entries;
+    unsigned int capacity;     // Always a power of two
+    unsigned int used;         // Entries in use
+    unsigned int deleted;      // Tombstones
+} *_worker_map_t;
+
+/* FNV-1a over the identity's bytes; the identities generated by
+ * s_set_id_server share their prefix, so every byte has to count */
+uint32_t worker_map_hash(const char *identity) {
+    uint32_t hash = 2166136261u;
+    
+    while (*identity) {
+        hash ^= (unsigned char) *identity++;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+/* Returns the entry of an identity or, if it is missing, the entry where it
+ * has to be inserted: the first tombstone or the empty entry ending the
+ * probing sequence */
+static
+worker_map_entry_t *worker_map_find(_worker_map_t map, const char *identity,
+    uint32_t hash) {
+    unsigned int mask = map->capacity - 1;
+    unsigned int it = hash & mask;
+    worker_map_entry_t *tombstone = NULL;
+    
+    while (1) {
+        worker_map_entry_t *entry = &map->entries[it];
+        
+        if (entry->worker_id == WORKER_MAP_EMPTY) {
+            return tombstone ? tombstone : entry;
+        }
+        
+        if (entry->worker_id == WORKER_MAP_DELETED) {
+            if (!tombstone) {
+                tombstone = entry;
+            }
+        } else if (entry->hash == hash && !strcmp(entry->identity, identity)) {
+            return entry;
+        }
+        
+        it = (it + 1) & mask;
+    }
+}
+
+static
+int worker_map_rehash(_worker_map_t map, unsigned int capacity) {
+    worker_map_entry_t *entries = (worker_map_entry_t *)
+        malloc(capacity * sizeof(worker_map_entry_t));
+    if (!entries) {
+        return -1;
+    }
+    
+    unsigned int it;
+    for (it = 0; it < capacity; it++) {
+        entries[it].worker_id = WORKER_MAP_EMPTY;
+    }
+    
+    worker_map_entry_t *old_entries = map->entries;
+    unsigned int old_capacity = map->capacity;
+    
+    map->entries = entries;
+    map->capacity = capacity;
+    map->deleted = 0;
+    
+    for (it = 0; it < old_capacity; it++) {
+        if (old_entries[it].worker_id >= 0) {
+            *worker_map_find(map, old_entries[it].identity,
+                old_entries[it].hash) = old_entries[it];
+        }
+    }
+    
+    free(old_entries);
+    return 0;
+}
+
+worker_map_t worker_map_new(void) {
+    _worker_map_t map = (_worker_map_t) calloc(1, sizeof(struct __worker_map_t));
+    if (!map) {
+        return NULL;
+    }
+    
+    if (worker_map_rehash(map, WORKER_MAP_MIN_CAPACITY)) {
+        free(map);
+        return NULL;
+    }
+    
+    return map;
+}
+
+void worker_map_delete(worker_map_t worker_map) {
+    _worker_map_t map = (_worker_map_t) worker_map;
+    if (!map) {
+        return;
+    }
+    
+    free(map->entries);
+    free(map);
+}
+
+int worker_map_put(worker_map_t worker_map, const char *identity, int worker_id) {
+    _worker_map_t map = (_worker_map_t) worker_map;
+    if (!map || !identity || worker_id < 0) {
+        return -1;
+    }
+    
+    // Keep at most 3/4 of the entries busy, counting the tombstones, so that
+    // the probing sequences stay short; only grow if the entries in use need
+    // it, otherwise dropping the tombstones is enough
+    if (4 * (map->used + map->deleted + 1) > 3 * map->capacity) {
+        unsigned int capacity = map->capacity;
+        if (4 * (map->used + 1) > 2 * capacity) {
+            capacity <<= 1;
+        }
+        if (worker_map_rehash(map, capacity)) {
+            return -1;
+        }
+    }
+    
+    uint32_t hash = worker_map_hash(identity);
+    worker_map_entry_t *entry = worker_map_find(map, identity, hash);
+    
+    if (entry->worker_id < 0) {
+        if (entry->worker_id == WORKER_MAP_DELETED) {
+            map->deleted--;
+        }
+        map->used++;
+    }
+    
+    entry->identity = identity;
+    entry->hash = hash;
+    entry->worker_id = worker_id;
+    
+    return 0;
+}
+
+int worker_map_get(worker_map_t worker_map, const char *identity) {
+    _worker_map_t map = (_worker_map_t) worker_map;
+    if (!map || !identity) {
+        return INVALID_WORKER_ID;
+    }
+    
+    worker_map_entry_t *entry = worker_map_find(map, identity,
+        worker_map_hash(identity));
+    
+    return entry->worker_id >= 0 ? entry->worker_id : INVALID_WORKER_ID;
+}
+
+int worker_map_remove(worker_map_t worker_map, const char *identity) {
+    _worker_map_t map = (_worker_map_t) worker_map;
+    if (!map || !identity) {
+        return -1;
+    }
+    
+    worker_map_entry_t *entry = worker_map_find(map, identity,
+        worker_map_hash(identity));
+    if (entry->worker_id < 0) {
+        return -1;
+    }
+    
+    entry->identity = NULL;
+    entry->worker_id = WORKER_MAP_DELETED;
+    map->used--;
+    map->deleted++;
+    
+    return 0;
+}
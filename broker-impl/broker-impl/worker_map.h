@@ -0,0 +1,55 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Hash table from the servers' identities to the broker's worker slots, used to
+ find the worker of a reply without scanning all the workers.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef broker_impl_worker_map_h
+#define broker_impl_worker_map_h
+
+#include "worker.h"
+
+typedef void *worker_map_t;
+
+/* Creates a new, empty, map */
+worker_map_t worker_map_new(void);
+
+/* Frees the memory occupied by this map; the identities are not freed */
+void worker_map_delete(worker_map_t map);
+
+/* Maps a server's identity to a worker slot, replacing the previous slot of
+ * that identity; the identity is not copied, so it must live as long as it is
+ * in the map. Returns 0 for success */
+int worker_map_put(worker_map_t map, const char *identity, int worker_id);
+
+/* Returns the worker slot of a server's identity, or INVALID_WORKER_ID */
+int worker_map_get(worker_map_t map, const char *identity);
+
+/* Removes a server's identity from the map; returns 0 if it was found */
+int worker_map_remove(worker_map_t map, const char *identity);
+
+/* Hash of an identity, as used by the map; also spreads the clients over the
+ * broker's shards */
+uint32_t worker_map_hash(const char *identity);
+
+#endif
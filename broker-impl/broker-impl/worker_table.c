@@ -0,0 +1,251 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Table of the broker's workers: the fields read by the scheduling scans are
+ kept in one array per field, apart from the rest of the workers' state.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "worker_table.h"
+
+#define WORKER_TABLE_MIN_CAPACITY      64
+
+int worker_table_init(worker_table_t *table) {
+    memset(table, 0, sizeof(worker_table_t));
+    return worker_table_reserve(table, WORKER_TABLE_MIN_CAPACITY);
+}
+
+void worker_table_destroy(worker_table_t *table) {
+    free(table->status);
+    free(table->cpu_load);
+    free(table->memory_load);
+    free(table->network_load);
+    free(table->effort);
+    free(table->states);
+    memset(table, 0, sizeof(worker_table_t));
+}
+
+/* Grows one of the table's arrays; on failure the array is left untouched */
+static
+int worker_table_grow(void **array, size_t element_size, int capacity) {
+    void *result = realloc(*array, capacity * element_size);
+    if (!result) {
+        return -1;
+    }
+    *array = result;
+    return 0;
+}
+
+int worker_table_reserve(worker_table_t *table, int count) {
+    if (count <= table->capacity) {
+        return 0;
+    }
+    
+    int capacity = table->capacity ? table->capacity : WORKER_TABLE_MIN_CAPACITY;
+    while (capacity < count) {
+        capacity <<= 1;
+    }
+    
+    if (worker_table_grow((void **) &table->status, sizeof(worker_status_t), capacity) ||
+        worker_table_grow((void **) &table->cpu_load, sizeof(double), capacity) ||
+        worker_table_grow((void **) &table->memory_load, sizeof(double), capacity) ||
+        worker_table_grow((void **) &table->network_load, sizeof(double), capacity) ||
+        worker_table_grow((void **) &table->effort, sizeof(double), capacity) ||
+        worker_table_grow((void **) &table->states, sizeof(worker_state_t), capacity)) {
+        return -1;
+    }
+    
+    table->capacity = capacity;
+    return 0;
+}
+
+void worker_table_set(worker_table_t *table, int worker_id, worker_state_t state) {
+    table->states[worker_id] = state;
+    worker_table_refresh(table, worker_id);
+}
+
+void worker_table_refresh(worker_table_t *table, int worker_id) {
+    worker_state_t state = table->states[worker_id];
+    
+    table->status[worker_id] = state->status;
+    table->cpu_load[worker_id] = state->runtime.cpu_load;
+    table->memory_load[worker_id] = state->runtime.memory_load;
+    table->network_load[worker_id] = state->runtime.network_load;
+    table->effort[worker_id] = get_runtime_effort(&state->runtime, state->status);
+}
+
+/* Appends base + the index of every bit set in mask to list */
+static inline
+void emit_candidates(int *list, int *count, int base, unsigned int mask) {
+    while (mask) {
+        list[(*count)++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+}
+
+/* Scalar kernel, for the workers in [from, to); it also handles the tail
+ * left by the vector kernels */
+static
+void classify_loads_scalar(worker_table_t *table, double *snapshot,
+    worker_load_classes_t *classes, int from, int to) {
+    int it;
+    
+    /* Same formula as get_runtime_load, over the hot arrays */
+    for (it = from; it < to; it++) {
+        double load = (table->cpu_load[it] +
+            table->network_load[it] +
+            table->memory_load[it]) / 3.0;
+        
+        snapshot[it] = load;
+        
+        if (load <= WORKER_IDLE_LOAD_THRESHOLD) {
+            classes->idle[classes->idle_count++] = it;
+        } else if (load <= WORKER_ACCEPT_LOAD_THRESHOLD) {
+            classes->host_count++;
+        } else if (load >= WORKER_OVER_LOAD_THRESHOLD) {
+            classes->overload[classes->overload_count++] = it;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* The vector kernels add and divide in the same order as the scalar one, so
+ * the loads are bit for bit the same */
+
+__attribute__((target("avx2")))
+static
+void classify_loads_avx2(worker_table_t *table, double *snapshot,
+    worker_load_classes_t *classes) {
+    const __m256d three = _mm256_set1_pd(3.0);
+    const __m256d idle = _mm256_set1_pd(WORKER_IDLE_LOAD_THRESHOLD);
+    const __m256d accept = _mm256_set1_pd(WORKER_ACCEPT_LOAD_THRESHOLD);
+    const __m256d over = _mm256_set1_pd(WORKER_OVER_LOAD_THRESHOLD);
+    int it;
+    
+    for (it = 0; it + 4 <= table->count; it += 4) {
+        __m256d load = _mm256_add_pd(_mm256_loadu_pd(table->cpu_load + it),
+            _mm256_loadu_pd(table->network_load + it));
+        load = _mm256_div_pd(
+            _mm256_add_pd(load, _mm256_loadu_pd(table->memory_load + it)), three);
+        _mm256_storeu_pd(snapshot + it, load);
+        
+        unsigned int idle_mask = _mm256_movemask_pd(_mm256_cmp_pd(load, idle, _CMP_LE_OQ));
+        unsigned int accept_mask = _mm256_movemask_pd(_mm256_cmp_pd(load, accept, _CMP_LE_OQ));
+        unsigned int over_mask = _mm256_movemask_pd(_mm256_cmp_pd(load, over, _CMP_GE_OQ));
+        
+        emit_candidates(classes->idle, &classes->idle_count, it, idle_mask);
+        emit_candidates(classes->overload, &classes->overload_count, it, over_mask);
+        classes->host_count += __builtin_popcount(accept_mask & ~idle_mask);
+    }
+    
+    classify_loads_scalar(table, snapshot, classes, it, table->count);
+}
+
+__attribute__((target("sse2")))
+static
+void classify_loads_sse2(worker_table_t *table, double *snapshot,
+    worker_load_classes_t *classes) {
+    const __m128d three = _mm_set1_pd(3.0);
+    const __m128d idle = _mm_set1_pd(WORKER_IDLE_LOAD_THRESHOLD);
+    const __m128d accept = _mm_set1_pd(WORKER_ACCEPT_LOAD_THRESHOLD);
+    const __m128d over = _mm_set1_pd(WORKER_OVER_LOAD_THRESHOLD);
+    int it;
+    
+    for (it = 0; it + 2 <= table->count; it += 2) {
+        __m128d load = _mm_add_pd(_mm_loadu_pd(table->cpu_load + it),
+            _mm_loadu_pd(table->network_load + it));
+        load = _mm_div_pd(
+            _mm_add_pd(load, _mm_loadu_pd(table->memory_load + it)), three);
+        _mm_storeu_pd(snapshot + it, load);
+        
+        unsigned int idle_mask = _mm_movemask_pd(_mm_cmple_pd(load, idle));
+        unsigned int accept_mask = _mm_movemask_pd(_mm_cmple_pd(load, accept));
+        unsigned int over_mask = _mm_movemask_pd(_mm_cmpge_pd(load, over));
+        
+        emit_candidates(classes->idle, &classes->idle_count, it, idle_mask);
+        emit_candidates(classes->overload, &classes->overload_count, it, over_mask);
+        classes->host_count += __builtin_popcount(accept_mask & ~idle_mask);
+    }
+    
+    classify_loads_scalar(table, snapshot, classes, it, table->count);
+}
+
+#endif
+
+void worker_table_classify_loads(worker_table_t *table, double *snapshot,
+    worker_load_classes_t *classes) {
+    classes->idle_count = 0;
+    classes->overload_count = 0;
+    classes->host_count = 0;
+    
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        classify_loads_avx2(table, snapshot, classes);
+    } else if (__builtin_cpu_supports("sse2")) {
+        classify_loads_sse2(table, snapshot, classes);
+    } else {
+        classify_loads_scalar(table, snapshot, classes, 0, table->count);
+    }
+#else
+    classify_loads_scalar(table, snapshot, classes, 0, table->count);
+#endif
+}
+
+/* xorshift32, cheaper than rand() and without its lock */
+static inline
+uint32_t next_random(uint32_t *seed) {
+    uint32_t x = *seed ? *seed : 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+int worker_table_least_effort_of(worker_table_t *table, int choices,
+    uint32_t *seed) {
+    int best_worker_id = INVALID_WORKER_ID;
+    int it;
+    
+    if (table->count == 0) {
+        return INVALID_WORKER_ID;
+    }
+    
+    for (it = 0; it < choices; it++) {
+        // Uniform in [0, count), without a division
+        int worker_id = (int) (((uint64_t) next_random(seed) * table->count) >> 32);
+        
+        if (table->status[worker_id] == DEAD) {
+            continue;
+        }
+        
+        if (best_worker_id == INVALID_WORKER_ID ||
+            table->effort[worker_id] < table->effort[best_worker_id]) {
+            best_worker_id = worker_id;
+        }
+    }
+    
+    return best_worker_id;
+}
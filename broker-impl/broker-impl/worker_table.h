@@ -0,0 +1,92 @@
+/*!
+ Load balancer for clients that want to execute commands on remote servers,
+ using the 0-MQ library.
+ 
+ Table of the broker's workers: the fields read by the scheduling scans are
+ kept in one array per field, apart from the rest of the workers' state.
+ 
+ Copyright (C) 2013 Laurentiu Dascalu (ldascalu@twitter.com).
+ 
+ @author Dascalu Laurentiu
+ 
+ This program is free software; you can redistribute it and
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 3
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef broker_impl_worker_table_h
+#define broker_impl_worker_table_h
+
+#include "worker.h"
+
+typedef struct __worker_table_t {
+    /* Number of used slots and number of allocated slots */
+    int count;
+    int capacity;
+    
+    /* Hot fields, one array per field, indexed by the worker's slot; they
+     * mirror the worker's state as of its last worker_table_refresh */
+    worker_status_t *status;
+    double *cpu_load;
+    double *memory_load;
+    double *network_load;
+    double *effort;
+    
+    /* Cold data: identity, tasks queue, mutex and the full runtime */
+    worker_state_t *states;
+} worker_table_t;
+
+/* Initializes an empty table; returns 0 for success */
+int worker_table_init(worker_table_t *table);
+
+/* Frees the arrays of this table; the workers' states are not freed */
+void worker_table_destroy(worker_table_t *table);
+
+/* Makes room for at least count slots; returns 0 for success */
+int worker_table_reserve(worker_table_t *table, int count);
+
+/* Stores a worker's state in a slot below count and refreshes its hot fields */
+void worker_table_set(worker_table_t *table, int worker_id, worker_state_t state);
+
+/* Copies the hot fields of a worker from its state, after they changed */
+void worker_table_refresh(worker_table_t *table, int worker_id);
+
+/* Workers classified by load against the WORKER_*_LOAD_THRESHOLD values */
+typedef struct __worker_load_classes_t {
+    /* IDLE workers, load <= WORKER_IDLE_LOAD_THRESHOLD */
+    int *idle;
+    int idle_count;
+    
+    /* Overloaded workers, load >= WORKER_OVER_LOAD_THRESHOLD */
+    int *overload;
+    int overload_count;
+    
+    /* Workers that can host tasks, IDLE < load <= WORKER_ACCEPT_LOAD_THRESHOLD */
+    int host_count;
+} worker_load_classes_t;
+
+/* In a single pass, writes the load of every worker, as returned by
+ * get_runtime_load, to snapshot and classifies the workers, in increasing
+ * slot order; snapshot, classes->idle and classes->overload must have room
+ * for count values. Uses AVX2 or SSE2 when the CPU has them. */
+void worker_table_classify_loads(worker_table_t *table, double *snapshot,
+    worker_load_classes_t *classes);
+
+/* Power of d choices: samples choices workers at random, with replacement,
+ * and returns the one with the least effort, skipping DEAD workers; seed is
+ * the caller's random state. Returns INVALID_WORKER_ID if every sample was
+ * DEAD. */
+int worker_table_least_effort_of(worker_table_t *table, int choices,
+    uint32_t *seed);
+
+#endif
@@ -44,7 +44,14 @@ int main(int argc, char **argv) {
     // Send a request
     char *command_to_execute = argc == 1 ? DEFAULT_COMMAND_TO_EXECUTE: argv[1];
     CLIENT_PRINT(client_id, "trying to execute %s\n", command_to_execute);
-    s_send (client, command_to_execute);
+    
+    if (argc > 2) {
+        // The optional second argument is the deadline, in milliseconds
+        s_sendmore (client, command_to_execute);
+        s_send (client, argv[2]);
+    } else {
+        s_send (client, command_to_execute);
+    }
     
     // Get the response and print out its content
     char *reply = s_recv (client);
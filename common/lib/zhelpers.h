@@ -52,19 +52,65 @@ void gen_random_client_id(char *s, const int len) {
     s[len] = 0;
 }
 
-//  Receive 0MQ string from socket and convert into C string
-//  Caller must free returned string. Returns NULL if the context
-//  is being terminated.
+//  Receive 0MQ string from socket and convert into C string, whatever
+//  its size. Caller must free returned string. Returns NULL if the
+//  context is being terminated.
 static char *
 s_recv (void *socket) {
-    char buffer [1 << 12];
-    int size = zmq_recv (socket, buffer, (1 << 12) - 1, 0);
-    if (size == -1)
+    zmq_msg_t message;
+    zmq_msg_init (&message);
+    int size = zmq_msg_recv (&message, socket, 0);
+    if (size == -1) {
+        zmq_msg_close (&message);
         return NULL;
-    if (size >= (1 << 12))
-        size = (1 << 12) - 1;
-    buffer [size] = 0;
-    return strdup (buffer);
+    }
+    char *string = malloc (size + 1);
+    memcpy (string, zmq_msg_data (&message), size);
+    zmq_msg_close (&message);
+    string [size] = 0;
+    return string;
+}
+
+//  Receive a frame from socket without copying it. Caller must close
+//  the frame, or hand it over with s_send_frame. Returns the frame's
+//  size, or -1 if the context is being terminated.
+static int
+s_recv_frame (void *socket, zmq_msg_t *frame) {
+    zmq_msg_init (frame);
+    int size = zmq_msg_recv (frame, socket, 0);
+    if (size == -1)
+        zmq_msg_close (frame);
+    return size;
+}
+
+//  Send a frame received with s_recv_frame; its content moves to the
+//  socket, without a copy, and the frame is closed
+static int
+s_send_frame (void *socket, zmq_msg_t *frame, int flags) {
+    int size = zmq_msg_send (frame, socket, flags);
+    zmq_msg_close (frame);
+    return size;
+}
+
+//  Returns 1 if the frame holds exactly string
+static int
+s_frame_equals (zmq_msg_t *frame, char *string) {
+    size_t size = strlen (string);
+    return zmq_msg_size (frame) == size
+        && !memcmp (zmq_msg_data (frame), string, size);
+}
+
+//  Copy up to max_size bytes of a frame into a C string
+//  Caller must free returned string.
+static char *
+s_frame_strndup (zmq_msg_t *frame, size_t max_size) {
+    size_t size = zmq_msg_size (frame);
+    if (size > max_size)
+        size = max_size;
+    char *string = malloc (size + 1);
+    memcpy (string, zmq_msg_data (frame), size);
+    string [size] = 0;
+    return string;
 }
 
 //  Convert C string to 0MQ string and send to socket
@@ -26,79 +26,562 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include "include/common.h"
 #include "lib/zhelpers.h"
 
-#define RESPONSE_SIZE     (1 << 12)
-#define BUFFER_SIZE       (1 << 8)
+/* Bytes read from a command's pipe at once; the output buffer doubles when
+ * it runs out of room for another read */
+#define CAPTURE_CHUNK_SIZE           (1 << 16)
 
-/* Static buffer used to respond to requests */
-static char buffer[RESPONSE_SIZE];
-static int buffer_size;
+/* Commands run at once, by default; advertised to the broker as credits */
+#define DEFAULT_CONCURRENCY          1
 
-/* Returns 0 if success and -1 if error */
-static int execute_remote_command(char *request);
+/* Inproc endpoint the executors send their results to */
+#define RESULTS_INPROC_LABEL         "inproc://server-results"
 
-int main(void) {
-    void *context = zmq_ctx_new ();
-    void *worker = zmq_socket (context, ZMQ_REQ);
+/* Largest number of results sent to the broker in one message */
+#define MAX_REPLY_BATCH              64
+
+/* Time between two heartbeats with the machine's measured load, in
+ * milliseconds */
+#define HEARTBEAT_INTERVAL_MS        1000
+
+/* Largest number of arguments of a command run without a shell */
+#define MAX_COMMAND_ARGUMENTS        256
+
+/* Longest report sent back with a task's output */
+#define TASK_REPORT_SIZE             128
+
+/* Request received from the broker, waiting for an executor */
+typedef struct __server_job_t {
+    char *client_id;
+    char *request;
+    
+    /* Sent by the broker along with the request and echoed in the report,
+     * NULL if there was none */
+    char *charges;
+    
+    struct __server_job_t *next;
+} *server_job_t;
+
+/* Costs of a command, from its spawn to its exit */
+typedef struct __command_cost_t {
+    /* Microseconds */
+    long wall_time;
+    long cpu_time;
+    
+    /* Maximum resident set size of the command, or of its largest process,
+     * in kilobytes */
+    long max_rss;
+} command_cost_t;
+
+/* Requests not taken by an executor yet, oldest first */
+static server_job_t jobs_head, jobs_tail;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void *context;
+
+/* Commands are split on whitespace and run without a shell, e.g. no pipes or
+ * redirections, but no /bin/sh started for every one of them either */
+static int shell_less;
+
+/* Time spent starting commands, for the spawn cost reports */
+static atomic_long spawned_tasks, spawn_time_total;
+
+extern char **environ;
+
+/* Starts a command with its standard output going to a pipe, without copying
+ * the server's address space; returns 0 if success and -1 if error */
+static int spawn_command(char *request, pid_t *pid, int *output_fd);
+
+/* Returns 0 if success and -1 if error; the output, which might hold any
+ * bytes, goes to a buffer of output_size bytes that the caller must free, and
+ * the command's costs go to cost */
+static int execute_remote_command(char *request, char **output,
+    size_t *output_size, command_cost_t *cost);
+
+/* Frees an output once 0MQ has sent it */
+static void free_output(void *data, void *hint);
+
+/* Executor thread: runs the queued requests, one at a time, and sends their
+ * results to the main thread, which owns the broker's socket */
+static void *executor_loop(void *input);
+
+/* Queues a request for the executors */
+static void queue_job(char *client_id, char *charges, char *request);
+
+/* Returns 1 if the socket has a message waiting, without blocking */
+static int has_pending_message(void *socket);
+
+/* Returns a field of /proc/meminfo, in kilobytes, or 0 if it is unknown */
+static long get_meminfo_field(char *name);
+
+/* Sends the machine's CPU utilisation since the previous heartbeat, the
+ * fraction of its memory in use and its runnable processes to the broker */
+static void send_heartbeat(void *worker);
+
+int main(int argc, char **argv) {
+    int concurrency = DEFAULT_CONCURRENCY;
+    long bandwidth = 0;
+    int option;
+    
+    while ((option = getopt(argc, argv, "c:ab:")) != -1) {
+        if (option == 'c' && atoi(optarg) > 0) {
+            concurrency = atoi(optarg);
+        } else if (option == 'a') {
+            shell_less = 1;
+        } else if (option == 'b' && atol(optarg) > 0) {
+            bandwidth = atol(optarg);
+        } else {
+            printf("usage: %s [-c concurrency] [-a] [-b bandwidth]\n", argv[0]);
+            printf("  -c  commands run at once (default %d)\n", DEFAULT_CONCURRENCY);
+            printf("  -a  run commands without a shell, split on whitespace\n");
+            printf("  -b  network bandwidth, in megabytes per second (default: the broker's)\n");
+            return -1;
+        }
+    }
+    
+    context = zmq_ctx_new ();
+    
+    // The broker keeps up to concurrency requests in flight, so the server
+    // talks to it asynchronously
+    void *worker = zmq_socket (context, ZMQ_DEALER);
     s_set_id_server (worker);
     int rc = zmq_connect (worker, BACKEND_IPC_LABEL);
     char server_id[17];
     size_t server_id_len;
     
+    if (rc) {
+        SERVER_PRINT(NULL, "cannot connect to %s: %s\n", BACKEND_IPC_LABEL,
+            zmq_strerror (zmq_errno ()));
+        zmq_close (worker);
+        zmq_ctx_destroy (context);
+        return -1;
+    }
+    
     if (s_get_id(worker, server_id, &server_id_len)) {
         return -1;
     }
     
-    s_send (worker, "READY");
-    SERVER_PRINT(server_id, "worker is ready!\n");
+    void *results = zmq_socket (context, ZMQ_PULL);
+    zmq_bind (results, RESULTS_INPROC_LABEL);
+    
+    int it;
+    for (it = 0; it < concurrency; it++) {
+        pthread_t executor;
+        pthread_create(&executor, NULL, executor_loop, NULL);
+        pthread_detach(executor);
+    }
+    
+    // Same envelope as a REQ socket, followed by the credits and the
+    // machine's resources, 0 for those that are unknown
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long memory = get_meminfo_field("MemTotal") / 1024;
+    char credits[16], cpus_field[16], memory_field[32], bandwidth_field[32];
+    snprintf(credits, sizeof(credits), "%d", concurrency);
+    snprintf(cpus_field, sizeof(cpus_field), "%ld", cpus > 0 ? cpus : 0);
+    snprintf(memory_field, sizeof(memory_field), "%ld", memory);
+    snprintf(bandwidth_field, sizeof(bandwidth_field), "%ld", bandwidth);
+    s_sendmore (worker, "");
+    s_sendmore (worker, "READY");
+    s_sendmore (worker, credits);
+    s_sendmore (worker, cpus_field);
+    s_sendmore (worker, memory_field);
+    s_send     (worker, bandwidth_field);
+    SERVER_PRINT(server_id, "worker is ready, %d credits, %ld cpus, %ldMB, %ldMB/s!\n",
+        concurrency, cpus, memory, bandwidth);
+    
+    // The first heartbeat only sets the CPU times the next one starts from
+    send_heartbeat(NULL);
+    int64_t heartbeat_at = s_clock() + HEARTBEAT_INTERVAL_MS;
     
     while (1) {
-        char *identity = s_recv (worker);
-        SERVER_PRINT(server_id, "fetching request from |%s|\n", identity);
-        char *empty = s_recv (worker); free (empty);
+        zmq_pollitem_t items[] = {
+            { worker, 0, ZMQ_POLLIN, 0 },
+            { results, 0, ZMQ_POLLIN, 0 },
+        };
         
-        //  Get request
-        char *request = s_recv (worker);
-        SERVER_PRINT(server_id, "processing request |%s|\n", request);
+        int64_t timeout = heartbeat_at - s_clock();
+        if (zmq_poll (items, 2, timeout > 0 ? timeout : 0) == -1)
+            break;
         
-        // Solve the request
-        char *result = execute_remote_command(request) ? SERVER_ERROR_MESSAGE : buffer;
-        free (request);
+        if (s_clock() >= heartbeat_at) {
+            send_heartbeat(worker);
+            heartbeat_at = s_clock() + HEARTBEAT_INTERVAL_MS;
+        }
+        
+        if (items[0].revents & ZMQ_POLLIN) {
+            char *empty = s_recv (worker); free (empty);
+            
+            // The broker might send a batch of requests in one message, each
+            // one a client's identity, the charges to echo, if any, an empty
+            // frame and the command
+            int more = 1;
+            while (more) {
+                char *identity = s_recv (worker);
+                SERVER_PRINT(server_id, "fetching request from |%s|\n", identity);
+                char *charges = s_recv (worker);
+                if (*charges) {
+                    empty = s_recv (worker); free (empty);
+                } else {
+                    free (charges);
+                    charges = NULL;
+                }
+                
+                //  Get request
+                char *request = s_recv (worker);
+                SERVER_PRINT(server_id, "processing request |%s|\n", request);
+                
+                // Queue it for the executors
+                queue_job(identity, charges, request);
+                
+                size_t more_size = sizeof(more);
+                zmq_getsockopt (worker, ZMQ_RCVMORE, &more, &more_size);
+            }
+        }
         
-        // Send the response
-        s_sendmore (worker, identity);
-        s_sendmore (worker, "");
-        s_send     (worker, result);
-        free (identity);
+        if (items[1].revents & ZMQ_POLLIN) {
+            // The results that are ready go back in one message, without
+            // waiting for the rest of their batch; the outputs are forwarded
+            // as received, without a copy
+            zmq_msg_t identities[MAX_REPLY_BATCH], reports[MAX_REPLY_BATCH];
+            zmq_msg_t replies[MAX_REPLY_BATCH];
+            int count = 0;
+            
+            do {
+                s_recv_frame (results, &identities[count]);
+                s_recv_frame (results, &reports[count]);
+                s_recv_frame (results, &replies[count]);
+                count++;
+            } while (count < MAX_REPLY_BATCH && has_pending_message(results));
+            
+            // Send the responses
+            s_sendmore (worker, "");
+            for (it = 0; it < count; it++) {
+                s_send_frame (worker, &identities[it], ZMQ_SNDMORE);
+                s_send_frame (worker, &reports[it], ZMQ_SNDMORE);
+                s_sendmore   (worker, "");
+                s_send_frame (worker, &replies[it],
+                    it + 1 < count ? ZMQ_SNDMORE : 0);
+            }
+        }
     }
     
+    zmq_close (results);
     zmq_close (worker);
     zmq_ctx_destroy (context);
     
     return 0;
 }
 
-int execute_remote_command(char *request) {
-    FILE *fp = popen(request, "r");
+void *executor_loop(void *input) {
+    (void) input;
+    void *results = zmq_socket (context, ZMQ_PUSH);
+    zmq_connect (results, RESULTS_INPROC_LABEL);
+    
+    while (1) {
+        pthread_mutex_lock (&jobs_mutex);
+        while (!jobs_head) {
+            pthread_cond_wait (&jobs_cond, &jobs_mutex);
+        }
+        server_job_t job = jobs_head;
+        jobs_head = job->next;
+        if (!jobs_head) {
+            jobs_tail = NULL;
+        }
+        pthread_mutex_unlock (&jobs_mutex);
+        
+        // Solve the request
+        char *output;
+        size_t output_size;
+        command_cost_t cost = { 0, 0, 0 };
+        int failed = execute_remote_command(job->request, &output,
+            &output_size, &cost);
+        
+        // The charges and the measured costs, for the broker's cost model
+        char report[TASK_REPORT_SIZE];
+        snprintf(report, sizeof(report), "%s %ld %ld %ld",
+            job->charges ? job->charges : "-", cost.wall_time, cost.cpu_time,
+            cost.max_rss);
+        
+        s_sendmore (results, job->client_id);
+        s_sendmore (results, report);
+        if (failed) {
+            s_send (results, SERVER_ERROR_MESSAGE);
+        } else {
+            // The output's buffer goes to 0MQ, which frees it once sent
+            zmq_msg_t result;
+            zmq_msg_init_data (&result, output, output_size, free_output, NULL);
+            zmq_msg_send (&result, results, 0);
+        }
+        
+        free (job->client_id);
+        free (job->charges);
+        free (job->request);
+        free (job);
+    }
+    
+    zmq_close (results);
+    return NULL;
+}
+
+void queue_job(char *client_id, char *charges, char *request) {
+    server_job_t job = (server_job_t) malloc(sizeof(struct __server_job_t));
+    job->client_id = client_id;
+    job->charges = charges;
+    job->request = request;
+    job->next = NULL;
+    
+    pthread_mutex_lock (&jobs_mutex);
+    if (jobs_tail) {
+        jobs_tail->next = job;
+    } else {
+        jobs_head = job;
+    }
+    jobs_tail = job;
+    pthread_cond_signal (&jobs_cond);
+    pthread_mutex_unlock (&jobs_mutex);
+}
+
+long get_meminfo_field(char *name) {
+    FILE *fp = fopen("/proc/meminfo", "r");
     if (!fp) {
+        return 0;
+    }
+    
+    char line[256];
+    size_t name_size = strlen(name);
+    long value = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (!strncmp(line, name, name_size) && line[name_size] == ':') {
+            sscanf(line + name_size + 1, "%ld", &value);
+            break;
+        }
+    }
+    fclose(fp);
+    
+    return value;
+}
+
+void send_heartbeat(void *worker) {
+    static long long previous_idle, previous_total;
+    long long times[8] = { 0 };
+    double cpu_load = 0.0, memory_load = 0.0;
+    long runnable = 0;
+    
+    // user, nice, system, idle, iowait, irq, softirq and steal jiffies
+    FILE *fp = fopen("/proc/stat", "r");
+    if (fp) {
+        if (fscanf(fp, "cpu %lld %lld %lld %lld %lld %lld %lld %lld", &times[0],
+            &times[1], &times[2], &times[3], &times[4], &times[5], &times[6],
+            &times[7]) >= 4) {
+            long long idle = times[3] + times[4], total = 0;
+            int it;
+            for (it = 0; it < 8; it++) {
+                total += times[it];
+            }
+            if (total > previous_total) {
+                cpu_load = 1.0 - (double) (idle - previous_idle) /
+                    (total - previous_total);
+            }
+            previous_idle = idle;
+            previous_total = total;
+        }
+        fclose(fp);
+    }
+    
+    if (!worker) {
+        return;
+    }
+    
+    long memory_total = get_meminfo_field("MemTotal");
+    if (memory_total > 0) {
+        memory_load = 1.0 -
+            (double) get_meminfo_field("MemAvailable") / memory_total;
+    }
+    
+    // Running processes, out of all of them, e.g. "2/180"; this one is one
+    // of them
+    fp = fopen("/proc/loadavg", "r");
+    if (fp) {
+        double average;
+        if (fscanf(fp, "%lf %lf %lf %ld", &average, &average, &average,
+            &runnable) == 4 && runnable > 0) {
+            runnable--;
+        }
+        fclose(fp);
+    }
+    
+    char cpu_field[32], memory_field[32], runnable_field[32];
+    snprintf(cpu_field, sizeof(cpu_field), "%.3lf", cpu_load);
+    snprintf(memory_field, sizeof(memory_field), "%.3lf", memory_load);
+    snprintf(runnable_field, sizeof(runnable_field), "%ld", runnable);
+    s_sendmore (worker, "");
+    s_sendmore (worker, "HEARTBEAT");
+    s_sendmore (worker, cpu_field);
+    s_sendmore (worker, memory_field);
+    s_send     (worker, runnable_field);
+}
+
+int has_pending_message(void *socket) {
+    int events;
+    size_t events_size = sizeof(events);
+    zmq_getsockopt (socket, ZMQ_EVENTS, &events, &events_size);
+    return (events & ZMQ_POLLIN) != 0;
+}
+
+int spawn_command(char *request, pid_t *pid, int *output_fd) {
+    char *argv[MAX_COMMAND_ARGUMENTS + 1];
+    char *command = NULL;
+    int argc = 0;
+    
+    if (shell_less) {
+        // The request is split in place; it is not used afterwards
+        char *saveptr;
+        char *argument = strtok_r(request, " \t\n", &saveptr);
+        while (argument && argc < MAX_COMMAND_ARGUMENTS) {
+            argv[argc++] = argument;
+            argument = strtok_r(NULL, " \t\n", &saveptr);
+        }
+        if (!argc) {
+            return -1;
+        }
+        command = argv[0];
+    } else {
+        // Same as popen
+        argv[argc++] = "sh";
+        argv[argc++] = "-c";
+        argv[argc++] = request;
+        command = "/bin/sh";
+    }
+    argv[argc] = NULL;
+    
+    // Commands spawned by the other executors must not inherit the pipe, or
+    // its reader would wait for them as well; pipe2 is not portable
+    int fds[2];
+    if (pipe(fds)) {
+        return -1;
+    }
+    if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) || fcntl(fds[1], F_SETFD, FD_CLOEXEC)) {
+        close(fds[0]);
+        close(fds[1]);
         return -1;
     }
     
-    memset(buffer, 0, sizeof(buffer));
-    buffer_size = 0;
-    static char line[BUFFER_SIZE];
-    int line_size;
-    memset(line, 0, sizeof(line));
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
     
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        line_size = strlen(line);
-        strncpy(buffer + buffer_size, line, line_size);
-        buffer_size += line_size;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // The child shares the server's memory until it runs the command, so the
+    // cost does not grow with the server's size
+    int rc = shell_less ?
+        posix_spawnp(pid, command, &actions, NULL, argv, environ) :
+        posix_spawn(pid, command, &actions, NULL, argv, environ);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    
+    if (rc) {
+        close(fds[0]);
+        return -1;
     }
     
-    pclose(fp);
+    long spawn_time = (end.tv_sec - start.tv_sec) * 1000000L +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    long tasks = atomic_fetch_add(&spawned_tasks, 1) + 1;
+    long total = atomic_fetch_add(&spawn_time_total, spawn_time) + spawn_time;
+    SERVER_PRINT(NULL, "spawned %s in %ldus (%.1lfus on average)\n",
+        command, spawn_time, (double) total / tasks);
     
+    *output_fd = fds[0];
     return 0;
 }
+
+int execute_remote_command(char *request, char **output,
+    size_t *output_size, command_cost_t *cost) {
+    struct timespec spawned, start, end;
+    clock_gettime(CLOCK_MONOTONIC, &spawned);
+    
+    pid_t pid;
+    int fd;
+    if (spawn_command(request, &pid, &fd)) {
+        return -1;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // Large reads straight from the pipe; the output is not split in lines,
+    // so it might hold any bytes
+    size_t capacity = 0, size = 0;
+    char *buffer = NULL;
+    ssize_t chunk_size;
+    
+    while (1) {
+        if (capacity - size < CAPTURE_CHUNK_SIZE) {
+            capacity = capacity ? 2 * capacity : CAPTURE_CHUNK_SIZE;
+            char *_buffer = (char *) realloc(buffer, capacity);
+            if (!_buffer) {
+                // Fails the task once the child is reaped
+                chunk_size = -1;
+                break;
+            }
+            buffer = _buffer;
+        }
+        chunk_size = read(fd, buffer + size, capacity - size);
+        if (chunk_size > 0) {
+            size += chunk_size;
+        } else if (chunk_size == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    
+    close(fd);
+    
+    // The child's resource usage includes its reaped descendants, e.g. the
+    // shell's commands
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    cost->wall_time = (end.tv_sec - spawned.tv_sec) * 1000000L +
+        (end.tv_nsec - spawned.tv_nsec) / 1000;
+    cost->cpu_time = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#ifdef __APPLE__
+    // In bytes there, in kilobytes on Linux
+    cost->max_rss = usage.ru_maxrss / 1024;
+#else
+    cost->max_rss = usage.ru_maxrss;
+#endif
+    
+    if (chunk_size < 0) {
+        free(buffer);
+        return -1;
+    }
+    
+    double seconds = (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+    SERVER_PRINT(NULL, "captured %zu bytes in %.3lfms (%.1lf MB/s)\n", size,
+        seconds * 1e3, seconds > 0 ? size / seconds / 1e6 : 0.0);
+    
+    *output = buffer;
+    *output_size = size;
+    return 0;
+}
+
+void free_output(void *data, void *hint) {
+    (void) hint;
+    free(data);
+}